@@ -98,8 +98,25 @@ struct trapframe {
     uint64    elr;
     uint64    spsr;
 };
+
+// read the virtual count of the generic timer
+static inline uint64 read_cntvct (void)
+{
+    uint64 val;
+
+    asm volatile("ISB; MRS %[r], CNTVCT_EL0": [r]"=r" (val)::);
+    return val;
+}
 #endif
 
+// ESR_EL1 (exception syndrome) for data aborts
+#define ESR_WNR         (1 << 6)            // caused by a write
+#define ESR_FSC(esr)    ((esr) & 0x3f)      // fault status code
+#define FSC_TYPE(fsc)   ((fsc) & 0x3c)      // fault type, without the level
+#define FSC_TRANS       0x04                // translation fault
+#define FSC_ACCESS      0x08                // access flag fault
+#define FSC_PERM        0x0c                // permission fault
+
 // cpsr/spsr bits
 #define NO_INT      0xc0
 #define DIS_INT     0x80
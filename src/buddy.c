@@ -6,229 +6,624 @@
 #include "mmu.h"
 #include "spinlock.h"
 #include "arm.h"
+#include "proc.h"
+#include "page.h"
+#include "shrinker.h"
+#include "kmemstat.h"
 
 
 // this file implement the buddy memory allocator. Each order divides
 // the memory pool into equal-sized blocks (2^n). We use bitmap to record
 // allocation status for each block. This allows for efficient merging
-// when blocks are freed. We also use double-linked list to chain together
-// free blocks (for each order), thus allowing fast allocation. There is
-// about 8% overhead (maximum) for this structure.
+// when blocks are freed. On top of the per-block bitmap of each order sit
+// summary bitmaps: a bit at level n+1 is set if the corresponding 64-bit
+// word at level n is non-zero. The top level is a single word, so finding
+// a free block is one count-trailing-zeros (RBIT+CLZ on AArch64) per level,
+// independent of how fragmented the order is. Marking a block free or in
+// use only touches the summary levels when a word changes between zero
+// and non-zero. The overhead is about two bits per smallest block.
+//
+// Block ids are counted from kmem.base, which is aligned to the largest
+// block size, so a block of order n is always physically aligned to 2^n
+// and can back a block (section) mapping of that size.
 
-#define MAX_ORD      12
+#define MAX_ORD      MAX_ALLOC_SHIFT     // a level-2 block mapping (2MB with 4KB pages)
 #define MIN_ORD      6
 #define N_ORD        (MAX_ORD - MIN_ORD +1)
 
-struct mark {
-    uint32  lnks;       // double links (actually indexes) 
-    uint32  bitmap;     // bitmap, whether the block is available (1=available)
+#define BM_SHIFT     6                   // 64 bits per bitmap word
+#define BM_BITS      (1 << BM_SHIFT)
+#define BM_LEVELS    5                   // block bitmap + summary levels
+
+// At boot only the first KMEM_EARLY bytes of whole top blocks are handed
+// to the allocator, which is plenty to reach the first user process. The
+// rest is published KMEM_POP_BATCH blocks at a time from the idle loop,
+// or right away when an allocation would otherwise fail.
+#define KMEM_EARLY      (16 * 1024 * 1024)
+#define KMEM_POP_BATCH  8
+
+// Free memory is kept between two watermarks, fractions of the managed
+// memory. Once it drops below the low one, allocations that may block
+// (no spinlock held) first ask the registered shrinkers for memory back
+// until the high one is reached, and so does the idle loop. An allocation
+// that finds nothing runs the shrinkers before it fails.
+#define WMARK_LOW_SHIFT     6               // 1/64 of memory
+#define WMARK_HIGH_SHIFT    5               // 1/32 of memory
+
+// Per-CPU magazines sit in front of the buddy lists for the small orders
+// (up to a page). Each is a bounded LIFO stack of free blocks that is only
+// touched by its own CPU with interrupts off, so the common kmalloc/kfree
+// never takes kmem.lock. An empty magazine is refilled, and a full one is
+// drained, by MAG_BATCH blocks at a time under a single lock round trip.
+#define MAG_MAX_ORD  PTE_SHIFT
+#define N_MAG_ORD    (MAG_MAX_ORD - MIN_ORD + 1)
+#define MAG_SIZE     32
+#define MAG_BATCH    (MAG_SIZE / 2)
+
+struct magazine {
+    int     cnt;                // number of cached blocks
+    void*   blks[MAG_SIZE];     // LIFO stack of free blocks
+};
+
+// counters used to size the magazines (see kmemdump)
+struct mag_stat {
+    uint64  alloc_hit;          // kmalloc served from the magazine
+    uint64  alloc_miss;         // kmalloc found the magazine empty
+    uint64  free_hit;           // kfree absorbed by the magazine
+    uint64  free_miss;          // kfree found the magazine full
+    uint64  refills;            // batches moved from the buddy lists
+    uint64  drains;             // batches moved back to the buddy lists
 };
 
-// lnks is a combination of previous link (index) and next link (index)
-#define PRE_LNK(lnks)   ((lnks) >> 16)
-#define NEXT_LNK(lnks)  ((lnks) & 0xFFFF)
-#define LNKS(pre, next) (((pre) << 16) | ((next) & 0xFFFF))
-#define NIL             ((uint16)0xFFFF)
+struct kmem_cpu {
+    struct magazine mags[N_MAG_ORD];
+    struct mag_stat stats[N_MAG_ORD];
+};
 
 struct order {
-    uint32  head;       // the first non-empty mark
-    uint32  offset;     // the first mark
+    uint64* bits[BM_LEVELS];    // bits[0]: 1=block available, bits[n]: summary
+    int     nlevels;            // bits[nlevels-1] is a single word
 };
 
 struct kmem {
     struct spinlock lock;
-    uint64            start;             // start of memory for marks
+    uint64            base;              // block 0 of every order
+    uint64            start;             // start of memory for bitmaps
     uint64            start_heap;        // start of allocatable memory
     uint64            end;
+    uint64            top;               // end of the memory added at boot
+    uint64            deferred;          // # of bytes in lazy
+    uint64            nfree;             // # of bytes in available blocks
+    uint64            total;             // # of bytes managed
+    uint64            wmark_low;
+    uint64            wmark_high;
+    uint64            reclaims;          // # of kmem_reclaim calls
+    struct shrinker*  shrinkers;
+    int               nlazy;
+    struct memrange   lazy[NMEMBANK + NMEMRESV]; // top blocks not yet added
     struct order    orders[N_ORD];  // orders used for buddy systems
 };
 
 static struct kmem kmem;
+static struct kmem_cpu kmem_cpus[NCPU];
+
+struct page *mem_map;
+uint64      mem_map_pa;
+uint64      mem_map_npages;
+
+// the allocator entry points account calls to the code that called them
+#define CALLER_PC()     ((uint64)__builtin_return_address(0))
+
+#ifdef CONFIG_KMEM_PROF
+// Allocation profiling: every kmalloc/kfree is counted against its call
+// site in a small open-addressed hash table keyed by the caller's return
+// address. Sites that no longer fit are only counted as dropped.
+static struct {
+    struct spinlock lock;
+    int             nsite;
+    uint64          dropped;
+    struct kmemsite sites[KMS_NSITE];
+} kprof;
+
+static void kprof_record (uint64 pc, int order, int is_free)
+{
+    struct kmemsite *site;
+    uint i, h;
+
+    h = (uint)(pc >> 2) * 2654435761u;
+
+    acquire(&kprof.lock);
+
+    for (i = 0; i < KMS_NSITE; i++) {
+        site = &kprof.sites[(h + i) % KMS_NSITE];
+
+        if (site->pc == pc) {
+            break;
+        }
+
+        if (site->pc == 0) {
+            site->pc = pc;
+            kprof.nsite++;
+            break;
+        }
+    }
+
+    if (i == KMS_NSITE) {
+        kprof.dropped++;
+
+    } else if (is_free) {
+        site->frees++;
+        site->free_bytes += 1ULL << order;
+
+    } else {
+        site->allocs++;
+        site->alloc_bytes += 1ULL << order;
+    }
+
+    release(&kprof.lock);
+}
+
+#define KPROF(pc, order, is_free)   kprof_record(pc, order, is_free)
+#else
+#define KPROF(pc, order, is_free)
+#endif
+
+static inline struct kmem_cpu* this_kmem_cpu (void)
+{
+    return &kmem_cpus[cpu - cpus];
+}
+
+// coversion between block id and memory address
+static inline void* blkid2mem (int order, uint64 blkid)
+{
+    return (void*)(kmem.base + (blkid << order));
+}
+
+static inline uint64 mem2blkid (int order, void *mem)
+{
+    return ((uint64)mem - kmem.base) >> order;
+}
+
+static inline int available (int order, uint64 blk_id)
+{
+    uint64 *bm;
+
+    bm = kmem.orders[order - MIN_ORD].bits[0];
+    return (bm[blk_id >> BM_SHIFT] >> (blk_id & (BM_BITS - 1))) & 1;
+}
+
+void _kfree (void *mem, int order);
+static void mag_drain (struct magazine *mag, struct mag_stat *st, int order, int n);
+
+// add the memory in [s, e) as the largest naturally aligned blocks
+// that fit, bypassing the magazines. Called with kmem.lock held.
+static void free_range (uint64 s, uint64 e)
+{
+    uint64 i;
+    int order;
 
-// coversion between block id to mark and memory address
-static inline struct mark* get_mark (int order, int idx)
+    for (i = s; i + PTE_SZ <= e; i += (1 << order)) {
+        order = MAX_ORD;
+
+        while ((i & ((1 << order) - 1)) || (i + (1 << order) > e)) {
+            order--;
+        }
+
+        _kfree((void*)i, order);
+    }
+}
+
+// mark the n top-order blocks from blk_id available at once: whole
+// words of the block bitmap are written directly, and each summary
+// level is rebuilt only over the words that changed. The blocks have
+// no buddy to merge with, so this is equivalent to n calls of _kfree.
+// Called with kmem.lock held.
+static void mark_range (uint64 blk_id, uint64 n)
+{
+    struct order    *ord;
+    uint64          *bm;
+    uint64          first, last, w, mask;
+    int             lvl;
+
+    ord   = &kmem.orders[MAX_ORD - MIN_ORD];
+    bm    = ord->bits[0];
+    first = blk_id;
+    last  = blk_id + n - 1;
+
+    for (w = first >> BM_SHIFT; w <= (last >> BM_SHIFT); w++) {
+        mask = ~0ULL;
+
+        if (w == (first >> BM_SHIFT)) {
+            mask &= ~0ULL << (first & (BM_BITS - 1));
+        }
+
+        if (w == (last >> BM_SHIFT)) {
+            mask &= ~0ULL >> (BM_BITS - 1 - (last & (BM_BITS - 1)));
+        }
+
+        if (bm[w] & mask) {
+            panic("kmem: double free");
+        }
+
+        bm[w] |= mask;
+    }
+
+    kmem.nfree += n << MAX_ORD;
+
+    for (lvl = 1; lvl < ord->nlevels; lvl++) {
+        first >>= BM_SHIFT;
+        last  >>= BM_SHIFT;
+
+        for (w = first; w <= last; w++) {
+            if (ord->bits[lvl - 1][w] != 0) {
+                ord->bits[lvl][w >> BM_SHIFT] |= 1ULL << (w & (BM_BITS - 1));
+            }
+        }
+    }
+}
+
+// publish up to n of the top blocks that kmem_init2 left out, returns
+// the number of blocks added. Called with kmem.lock held.
+static int populate (uint64 n)
 {
-    return (struct mark*)kmem.start + (kmem.orders[order - MIN_ORD].offset + idx);
+    struct memrange *r;
+    uint64 k, done;
+    int i;
+
+    for (i = 0, done = 0; (i < kmem.nlazy) && (done < n); i++) {
+        r = &kmem.lazy[i];
+        k = (r->end - r->start) >> MAX_ORD;
+
+        if (k > n - done) {
+            k = n - done;
+        }
+
+        if (k > 0) {
+            mark_range(mem2blkid(MAX_ORD, (void*)r->start), k);
+            r->start      += k << MAX_ORD;
+            kmem.deferred -= k << MAX_ORD;
+            done          += k;
+        }
+    }
+
+    return done;
 }
 
-static inline void* blkid2mem (int order, int blkid)
+// add some more of the deferred memory to the allocator. Called from
+// the idle loop, returns 0 once all memory is in.
+int kmem_populate (void)
 {
-    return (void*)(kmem.start_heap + (1 << order) * blkid);
+    int n;
+
+    if (kmem.deferred == 0) {
+        return 0;
+    }
+
+    acquire(&kmem.lock);
+    n = populate(KMEM_POP_BATCH);
+    release(&kmem.lock);
+
+    return n;
 }
 
-static inline int mem2blkid (int order, void *mem)
+// give the pages in [s, e) a reference that is never dropped
+static void reserve_pages (uint64 s, uint64 e)
 {
-    return ((uint64)mem - kmem.start_heap) >> order;
+    struct page *pg;
+
+    for (; s < e; s += PTE_SZ) {
+        pg = &mem_map[(s - kmem.base) >> PTE_SHIFT];
+        pg->ref   = 1;
+        pg->flags = PG_RESERVED;
+    }
 }
 
-static inline int available (uint bitmap, int blk_id)
+// add the RAM in [s, e) to the allocator, minus the reserved regions
+// from r on. The unaligned head and tail are freed block by block, the
+// top blocks in between are deferred (see kmem_populate). Ranges must
+// be added in address order. Called with kmem.lock held.
+static void add_range (uint64 s, uint64 e, int r)
 {
-    return bitmap & (1 << (blk_id & 0x1F));
+    uint64 rs, re, lo, hi;
+
+    for (; r < meminfo.nresv; r++) {
+        rs = (uint64)P2V(align_dn(meminfo.resv[r].start, PTE_SZ));
+        re = (uint64)P2V(align_up(meminfo.resv[r].end, PTE_SZ));
+
+        if ((rs < e) && (re > s)) {
+            add_range(s, rs, r + 1);
+            add_range(re, e, r + 1);
+            return;
+        }
+    }
+
+    s = align_up(s, PTE_SZ);
+    e = align_dn(e, PTE_SZ);
+
+    if (s >= e) {
+        return;
+    }
+
+    // holes and reserved regions since the last range
+    reserve_pages(kmem.top, s);
+    kmem.top = e;
+    kmem.total += e - s;
+
+    lo = align_up(s, 1 << MAX_ORD);
+    hi = align_dn(e, 1 << MAX_ORD);
+
+    if (lo >= hi) {
+        free_range(s, e);
+        return;
+    }
+
+    free_range(s, lo);
+    free_range(hi, e);
+
+    kmem.lazy[kmem.nlazy].start = lo;
+    kmem.lazy[kmem.nlazy].end   = hi;
+    kmem.nlazy++;
+    kmem.deferred += hi - lo;
 }
 
 void kmem_init (void)
 {
     initlock(&kmem.lock, "kmem");
+
+#ifdef CONFIG_KMEM_PROF
+    initlock(&kprof.lock, "kprof");
+#endif
+}
+
+static inline uint64 kmem_free (void)
+{
+    return kmem.nfree + kmem.deferred;
+}
+
+// add a cache to the ones asked for memory by kmem_reclaim
+void register_shrinker (struct shrinker *sh)
+{
+    struct shrinker **pp;
+
+    acquire(&kmem.lock);
+
+    for (pp = &kmem.shrinkers; *pp != NULL; pp = &(*pp)->next)
+        ;
+
+    sh->next = NULL;
+    *pp = sh;
+
+    release(&kmem.lock);
+}
+
+// give the blocks in this CPU's magazines back to the buddy lists
+static void mag_flush (void)
+{
+    struct kmem_cpu *kc;
+    int ord;
+
+    pushcli();
+
+    kc = this_kmem_cpu();
+
+    for (ord = MIN_ORD; ord <= MAG_MAX_ORD; ord++) {
+        if (kc->mags[ord - MIN_ORD].cnt > 0) {
+            mag_drain(&kc->mags[ord - MIN_ORD], &kc->stats[ord - MIN_ORD], ord,
+                      kc->mags[ord - MIN_ORD].cnt);
+        }
+    }
+
+    popcli();
+}
+
+// ask the shrinkers, in registration order, for about nr pages. Object
+// caches release objects into the slabs, so a second pass lets an earlier
+// shrinker (slab) return the pages emptied by a later one (inodes). Must
+// be called without any spinlock held. Returns the # of pages gained.
+int kmem_reclaim (int nr)
+{
+    struct shrinker *sh;
+    uint64 start, target;
+    int pass;
+
+    start  = kmem_free();
+    target = start + ((uint64)nr << PTE_SHIFT);
+
+    kmem.reclaims++;
+
+    for (pass = 0; (pass < 2) && (kmem_free() < target); pass++) {
+        for (sh = kmem.shrinkers; sh != NULL; sh = sh->next) {
+            sh->released += sh->shrink(nr);
+        }
+
+        // the freed memory may sit in the magazines of this CPU
+        mag_flush();
+    }
+
+    return (kmem_free() > start) ? (kmem_free() - start) >> PTE_SHIFT : 0;
+}
+
+// reclaim up to the high watermark once free memory is below the low
+// one. Must be called without any spinlock held. Returns 1 if memory
+// is still short.
+int kmem_balance (void)
+{
+    uint64 free;
+
+    if ((free = kmem_free()) >= kmem.wmark_low) {
+        return 0;
+    }
+
+    kmem_reclaim((kmem.wmark_high - free) >> PTE_SHIFT);
+
+    return kmem_free() < kmem.wmark_high;
 }
 
 void kmem_init2(void *vstart, void *vend)
 {
-    long            i, j;
-    uint64          total, n;
-    uint64          len;
+    long            i, lvl;
+    uint64          n, words, s, e;
+    uint64          *bm;
     struct order    *ord;
-    struct mark     *mk;
-    
+
     kmem.start = (uint64)vstart;
     kmem.end   = (uint64)vend;
-    len = kmem.end - kmem.start;
+    kmem.base  = align_dn(kmem.start, 1 << MAX_ORD);
 
-    // reserved memory at vstart for an array of marks (for all the orders)
-    n = (len >> (MAX_ORD + 5)) + 1; // estimated # of marks for max order
-    total = 0;
-    
-    for (i = N_ORD - 1; i >= 0; i--) {
+    // reserve memory at vstart for the bitmaps of all the orders, sized
+    // for the whole range (the bitmaps themselves are not allocatable,
+    // which only over-estimates a little)
+    bm = (uint64*)kmem.start;
+
+    for (i = 0; i < N_ORD; i++) {
         ord = kmem.orders + i;
-        ord->offset = total;
-        ord->head = NIL;
-        
-        // set the bitmaps to mark all blocks not available
-        for (j = 0; j < n; j++) {
-            mk = get_mark(i + MIN_ORD, j);
-            mk->lnks = LNKS(NIL, NIL);
-            mk->bitmap = 0;
-        }
+        n = ((kmem.end - kmem.base) >> (i + MIN_ORD)) + 1;
+        lvl = 0;
+
+        do {
+            if (lvl == BM_LEVELS) {
+                panic("kmem_init2: too much memory for the bitmaps");
+            }
 
-        total += n;
-        n <<= 1;     // each order doubles required marks
+            words = (n + BM_BITS - 1) >> BM_SHIFT;
+            ord->bits[lvl++] = bm;
+
+            // initially no block is available
+            memset(bm, 0, words * sizeof(*bm));
+            bm += words;
+            n = words;
+        } while (words > 1);
+
+        ord->nlevels = lvl;
     }
 
-    // add all available memory to the highest order bucket
-    kmem.start_heap = align_up(kmem.start + total * sizeof(*mk), 1 << MAX_ORD);
-    
-    for (i = kmem.start_heap; i < kmem.end; i += (1 << MAX_ORD)){
-        kfree ((void*)i, MAX_ORD);
+    // the page descriptors follow the bitmaps. Everything that is not
+    // RAM handed to the allocator is reserved for good.
+    mem_map        = (struct page*)bm;
+    mem_map_pa     = v2p((void*)kmem.base);
+    mem_map_npages = (kmem.end - kmem.base) >> PTE_SHIFT;
+
+    memset(mem_map, 0, mem_map_npages * sizeof(struct page));
+
+    kmem.start_heap = align_up(mem_map + mem_map_npages, PTE_SZ);
+    kmem.top        = kmem.base;
+
+    acquire(&kmem.lock);
+
+    for (i = 0; i < meminfo.nbank; i++) {
+        s = (uint64)P2V(meminfo.bank[i].start);
+        e = (uint64)P2V(meminfo.bank[i].end);
+
+        if (e > kmem.start_heap) {
+            add_range((s < kmem.start_heap) ? kmem.start_heap : s, e, 0);
+        }
     }
+
+    reserve_pages(kmem.top, kmem.end);
+    // at least one block, which may be larger than KMEM_EARLY
+    populate(align_up(KMEM_EARLY, 1 << MAX_ORD) >> MAX_ORD);
+
+    kmem.wmark_low  = kmem.total >> WMARK_LOW_SHIFT;
+    kmem.wmark_high = kmem.total >> WMARK_HIGH_SHIFT;
+
+    release(&kmem.lock);
 }
 
-// mark a block as unavailable
-static void unmark_blk (int order, int blk_id)
+// mark a block as unavailable, clearing summary bits for words that
+// become empty
+static void unmark_blk (int order, uint64 blk_id)
 {
-    struct mark     *mk, *p;
     struct order    *ord;
-    int             prev, next;
+    uint64          *w;
+    int             lvl;
 
     ord = &kmem.orders[order - MIN_ORD];
-    mk  = get_mark (order, blk_id >> 5);
 
-    // clear the bit in the bitmap
-    if (!available(mk->bitmap, blk_id)) {
+    if (!available(order, blk_id)) {
         panic ("double alloc\n");
     }
 
-    mk->bitmap &= ~(1 << (blk_id & 0x1F));
-    
-    // if it's the last block in the bitmap, delete from the list
-    if (mk->bitmap == 0) {
-        blk_id >>= 5;
-        
-        prev = PRE_LNK(mk->lnks);
-        next = NEXT_LNK(mk->lnks);
-
-        if (prev != NIL) {
-            p = get_mark(order, prev);
-            p->lnks = LNKS(PRE_LNK(p->lnks), next);
-            
-        } else if (ord->head == blk_id) {
-            // if we are the first in the link
-            ord->head = next;
-        }
+    kmem.nfree -= 1ULL << order;
+
+    for (lvl = 0; lvl < ord->nlevels; lvl++) {
+        w = &ord->bits[lvl][blk_id >> BM_SHIFT];
+        *w &= ~(1ULL << (blk_id & (BM_BITS - 1)));
 
-        if (next != NIL) {
-            p = get_mark(order, next);
-            p->lnks = LNKS(prev, NEXT_LNK(p->lnks));
+        if (*w != 0) {
+            break;
         }
 
-        mk->lnks = LNKS(NIL, NIL);
+        blk_id >>= BM_SHIFT;
     }
 }
 
-// mark a block as available
-static void mark_blk (int order, int blk_id)
+// mark a block as available, setting summary bits for words that
+// become non-empty
+static void mark_blk (int order, uint64 blk_id)
 {
-    struct mark     *mk, *p;
     struct order    *ord;
-    int             insert;
-    
-    ord = &kmem.orders[order - MIN_ORD];
-    mk  = get_mark (order, blk_id >> 5);
+    uint64          *w;
+    uint64          old;
+    int             lvl;
 
-    // whether we need to insert it into the list
-    insert = (mk->bitmap == 0);
+    ord = &kmem.orders[order - MIN_ORD];
 
-    // clear the bit map
-    if (available(mk->bitmap, blk_id)) {
+    if (available(order, blk_id)) {
         panic ("double free\n");
     }
-    
-    mk->bitmap |= (1 << (blk_id & 0x1F));
-    
-    // just insert it to the head, no need to keep the list ordered
-    if (insert) {
-        blk_id >>= 5;
-        mk->lnks = LNKS(NIL, ord->head);
-
-        // fix the pre pointer of the next mark
-        if (ord->head != NIL) {
-            p = get_mark(order, ord->head);
-            p->lnks = LNKS(blk_id, NEXT_LNK(p->lnks));
+
+    kmem.nfree += 1ULL << order;
+
+    for (lvl = 0; lvl < ord->nlevels; lvl++) {
+        w = &ord->bits[lvl][blk_id >> BM_SHIFT];
+        old = *w;
+        *w = old | (1ULL << (blk_id & (BM_BITS - 1)));
+
+        if (old != 0) {
+            break;
         }
-        
-        ord->head = blk_id;
+
+        blk_id >>= BM_SHIFT;
     }
 }
 
-// get a block
-static void* get_blk (int order)
+// find the lowest available block of an order by descending the
+// summary levels, or return -1 if there is none
+static long find_blk (int order)
 {
-    struct mark *mk;
-    int blk_id;
-    int i;
-    struct order *ord;
+    struct order    *ord;
+    uint64          idx;
+    int             lvl;
 
     ord = &kmem.orders[order - MIN_ORD];
-    mk = get_mark(order, ord->head);
+    lvl = ord->nlevels - 1;
 
-    if (mk->bitmap == 0) {
-        panic ("empty mark in the list\n");
+    if (ord->bits[lvl][0] == 0) {
+        return -1;
     }
 
-    for (i = 0; i < 32; i++) {
-        if (mk->bitmap & (1 << i)) {
-            blk_id = ord->head * 32 + i;
-            unmark_blk(order, blk_id);
-            
-            return blkid2mem(order, blk_id);
-        }
+    for (idx = 0; lvl >= 0; lvl--) {
+        idx = (idx << BM_SHIFT) + __builtin_ctzll(ord->bits[lvl][idx]);
     }
 
-    return NULL;
+    return idx;
 }
 
-void _kfree (void *mem, int order);
-
-
 static void *_kmalloc (int order)
 {
-    struct order *ord;
+    long          blk_id;
     uint8         *up;
 
-    ord = &kmem.orders[order - MIN_ORD];
     up  = NULL;
-    
-    if (ord->head != NIL) {
-        up = get_blk(order);
-        
+
+    if (((blk_id = find_blk(order)) < 0) && (order == MAX_ORD) && populate(KMEM_POP_BATCH)) {
+        blk_id = find_blk(order);
+    }
+
+    if (blk_id >= 0) {
+        unmark_blk(order, blk_id);
+        up = blkid2mem(order, blk_id);
+
     } else if (order < MAX_ORD){
         // if currently no block available, try to split a parent
         up = _kmalloc (order + 1);
@@ -241,37 +636,210 @@ static void *_kmalloc (int order)
     return up;
 }
 
-// allocate memory that has the size of (1 << order)
-void *kmalloc (int order)
+#ifdef CONFIG_KMEM_BENCH
+#define BENCH_N     1024
+
+// the search done by the old allocator: having found a non-empty
+// bitmap word (it kept a list of them), test its bits one at a time.
+static long find_blk_bitscan (int order)
 {
-    uint8         *up;
+    struct order    *ord;
+    uint64          idx, w;
+    int             lvl, i;
 
-    if ((order > MAX_ORD) || (order < MIN_ORD)) {
-        panic("kmalloc: order out of range\n");
+    ord = &kmem.orders[order - MIN_ORD];
+    lvl = ord->nlevels - 1;
+
+    if (ord->bits[lvl][0] == 0) {
+        return -1;
+    }
+
+    for (idx = 0; lvl >= 1; lvl--) {
+        idx = (idx << BM_SHIFT) + __builtin_ctzll(ord->bits[lvl][idx]);
+    }
+
+    w = ord->bits[0][idx];
+
+    for (i = 0; i < BM_BITS; i++) {
+        if (w & (1ULL << i)) {
+            return (idx << BM_SHIFT) + i;
+        }
+    }
+
+    return -1;
+}
+
+// boot-time microbenchmark: cost of the free-block search and of a
+// full allocation/free cycle, in generic timer ticks per BENCH_N ops.
+void kmem_bench (void)
+{
+    static void *blks[BENCH_N];
+    volatile long sink;
+    uint64 t0, t1, t2, t3;
+    int order, i;
+
+    for (order = MIN_ORD; order <= MAX_ORD; order += 2) {
+        acquire(&kmem.lock);
+
+        t0 = read_cntvct();
+
+        for (i = 0; i < BENCH_N; i++) {
+            sink = find_blk(order);
+        }
+
+        t1 = read_cntvct();
+
+        for (i = 0; i < BENCH_N; i++) {
+            sink = find_blk_bitscan(order);
+        }
+
+        t2 = read_cntvct();
+
+        for (i = 0; i < BENCH_N; i++) {
+            blks[i] = _kmalloc(order);
+        }
+
+        for (i = BENCH_N - 1; i >= 0; i--) {
+            if (blks[i] != NULL) {
+                _kfree(blks[i], order);
+            }
+        }
+
+        t3 = read_cntvct();
+
+        release(&kmem.lock);
+
+        cprintf("kmem_bench: order %d: search %d (bit-scan %d), alloc+free %d ticks/%d ops\n",
+                order, (uint)(t1 - t0), (uint)(t2 - t1), (uint)(t3 - t2), BENCH_N);
+    }
+
+    (void)sink;
+}
+#endif
+
+// move up to MAG_BATCH blocks from the buddy lists into an empty
+// magazine. Called with interrupts off (pushcli).
+static void mag_refill (struct magazine *mag, struct mag_stat *st, int order)
+{
+    void *up;
+
+    acquire(&kmem.lock);
+
+    while (mag->cnt < MAG_BATCH) {
+        if ((up = _kmalloc(order)) == NULL) {
+            break;
+        }
+
+        mag->blks[mag->cnt++] = up;
     }
 
+    release(&kmem.lock);
+    st->refills++;
+}
+
+// return the n oldest blocks (bottom of the stack) of a magazine to
+// the buddy lists, keeping the recently freed (cache-hot) ones.
+static void mag_drain (struct magazine *mag, struct mag_stat *st, int order, int n)
+{
+    int i;
+
     acquire(&kmem.lock);
-    up = _kmalloc(order);
+
+    for (i = 0; i < n; i++) {
+        _kfree(mag->blks[i], order);
+    }
+
     release(&kmem.lock);
 
+    memmove(mag->blks, mag->blks + n, (mag->cnt - n) * sizeof(mag->blks[0]));
+    mag->cnt -= n;
+    st->drains++;
+}
+
+// allocate a block from the magazines or the buddy lists, no reclaim
+static void *kmalloc_nowait (int order)
+{
+    uint8           *up;
+    struct kmem_cpu *kc;
+    struct magazine *mag;
+    struct mag_stat *st;
+
+    if (order > MAG_MAX_ORD) {
+        acquire(&kmem.lock);
+        up = _kmalloc(order);
+        release(&kmem.lock);
+
+        return up;
+    }
+
+    pushcli();
+
+    kc  = this_kmem_cpu();
+    mag = &kc->mags[order - MIN_ORD];
+    st  = &kc->stats[order - MIN_ORD];
+
+    if (mag->cnt > 0) {
+        st->alloc_hit++;
+    } else {
+        st->alloc_miss++;
+        mag_refill(mag, st, order);
+    }
+
+    up = (mag->cnt > 0) ? mag->blks[--mag->cnt] : NULL;
+
+    popcli();
+
+    return up;
+}
+
+static void *kmalloc_pc (int order, uint64 pc)
+{
+    void    *up;
+    int     can_reclaim;
+
+    if ((order > MAX_ORD) || (order < MIN_ORD)) {
+        panic("kmalloc: order out of range\n");
+    }
+
+    // the shrinkers take their own locks, so they can only run if we
+    // hold none (kmalloc is not used by interrupt handlers)
+    can_reclaim = (cpu->ncli == 0);
+
+    if (can_reclaim) {
+        kmem_balance();
+    }
+
+    if (((up = kmalloc_nowait(order)) == NULL) && can_reclaim &&
+        (kmem_reclaim(1 << ((order > PTE_SHIFT) ? order - PTE_SHIFT : 0)) > 0)) {
+        up = kmalloc_nowait(order);
+    }
+
+    if (up != NULL) {
+        KPROF(pc, order, 0);
+    }
+
     return up;
 }
 
+// allocate memory that has the size of (1 << order)
+void *kmalloc (int order)
+{
+    return kmalloc_pc(order, CALLER_PC());
+}
+
 void _kfree (void *mem, int order)
 {
-    int blk_id, buddy_id;
-    struct mark *mk;
+    uint64 blk_id, buddy_id;
 
     blk_id = mem2blkid(order, mem);
-    mk = get_mark(order, blk_id >> 5);
 
-    if (available(mk->bitmap, blk_id)) {
+    if (available(order, blk_id)) {
         panic ("kfree: double free");
     }
 
     buddy_id = blk_id ^ 0x0001; // blk_id and buddy_id differs in the last bit
-                                // buddy must be in the same bit map
-    if (!available(mk->bitmap, buddy_id) || (order == MAX_ORD)) {
+                                // buddy must be in the same bit map word
+    if ((order == MAX_ORD) || !available(order, buddy_id)) {
         mark_blk(order, blk_id);
     } else {
         // our buddy is also free, merge it
@@ -280,29 +848,164 @@ void _kfree (void *mem, int order)
     }
 }
 
+static void kfree_pc (void *mem, int order, uint64 pc)
+{
+    struct kmem_cpu *kc;
+    struct magazine *mag;
+    struct mag_stat *st;
+
+    if ((order > MAX_ORD) || (order < MIN_ORD) || (uint64)mem & ((1<<order) -1)) {
+        panic("kfree: order out of range or memory unaligned\n");
+    }
+
+    KPROF(pc, order, 1);
+
+    if (order > MAG_MAX_ORD) {
+        acquire(&kmem.lock);
+        _kfree(mem, order);
+        release(&kmem.lock);
+        return;
+    }
+
+    pushcli();
+
+    kc  = this_kmem_cpu();
+    mag = &kc->mags[order - MIN_ORD];
+    st  = &kc->stats[order - MIN_ORD];
+
+    if (mag->cnt < MAG_SIZE) {
+        st->free_hit++;
+    } else {
+        st->free_miss++;
+        mag_drain(mag, st, order, MAG_BATCH);
+    }
+
+    mag->blks[mag->cnt++] = mem;
+
+    popcli();
+}
+
 // free kernel memory, we require order parameter here to avoid
 // storing size info somewhere which might break the alignment
 void kfree (void *mem, int order)
 {
-    if ((order > MAX_ORD) || (order < MIN_ORD) || (uint64)mem & ((1<<order) -1)) {
-        panic("kfree: order out of range or memory unaligned\n");
+    kfree_pc(mem, order, CALLER_PC());
+}
+
+static void* alloc_pages_pc (int order, uint64 pc)
+{
+    struct page *pg;
+    void *v;
+
+    if ((order < 0) || (order > MAX_PAGE_ORDER)) {
+        panic("alloc_pages: order out of range\n");
     }
 
-    acquire(&kmem.lock);
-    _kfree(mem, order);
-    release(&kmem.lock);
+    if ((v = kmalloc_pc (PTE_SHIFT + order, pc)) == NULL) {
+        return NULL;
+    }
+
+    pg = virt2page(v);
+
+    if (pg->ref != 0) {
+        panic("alloc_pages: page in use");
+    }
+
+    pg->ref = 1;
+    return v;
+}
+
+// allocate 2^order physically contiguous pages, aligned to their size.
+// The first page holds the reference for the whole block.
+void* alloc_pages (int order)
+{
+    return alloc_pages_pc (order, CALLER_PC());
+}
+
+static void free_pages_pc (void *v, int order, uint64 pc)
+{
+    struct page *pg;
+
+    if ((order < 0) || (order > MAX_PAGE_ORDER)) {
+        panic("free_pages: order out of range\n");
+    }
+
+    if (((pg = virt2page(v)) == NULL) || (pg->flags & PG_RESERVED)) {
+        panic("free_pages: not an allocated page");
+    }
+
+    if (pg->ref == 0) {
+        panic("free_pages: page is free");
+    }
+
+    if (__atomic_sub_fetch(&pg->ref, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+
+    pg->flags = 0;
+    pg->owner = NULL;
+
+    kfree_pc (v, PTE_SHIFT + order, pc);
+}
+
+// drop a reference to 2^order pages allocated by alloc_pages, and
+// free them once the last reference is gone
+void free_pages (void *v, int order)
+{
+    free_pages_pc (v, order, CALLER_PC());
+}
+
+// Turn 2^order pages allocated by alloc_pages into single pages, each
+// with the references the block had, to be freed one by one.
+void split_pages (void *v, int order)
+{
+    struct page *pg;
+    int i;
+
+    if (((pg = virt2page(v)) == NULL) || (pg->ref == 0)) {
+        panic("split_pages: page is free");
+    }
+
+    for (i = 1; i < (1 << order); i++) {
+        pg[i].ref = pg->ref;
+        pg[i].flags = pg->flags;
+    }
 }
 
-// free a page
+// take another reference to an allocated page
+void get_page (void *v)
+{
+    struct page *pg;
+
+    if (((pg = virt2page(v)) == NULL) || (pg->ref == 0)) {
+        panic("get_page: page is free");
+    }
+
+    __atomic_add_fetch(&pg->ref, 1, __ATOMIC_RELAXED);
+}
+
+// # of references to a page
+int page_count (void *v)
+{
+    struct page *pg;
+
+    if ((pg = virt2page(v)) == NULL) {
+        return 0;
+    }
+
+    return __atomic_load_n(&pg->ref, __ATOMIC_RELAXED);
+}
+
+// drop a reference to a page, freeing it with the last one
 void free_page(void *v)
 {
-    kfree (v, PTE_SHIFT);
+    free_pages_pc (v, 0, CALLER_PC());
 }
 
-// allocate a page
+// allocate a page, with one reference held by the caller
 void* alloc_page (void)
 {
-    return kmalloc (PTE_SHIFT);
+    return alloc_pages_pc (0, CALLER_PC());
 }
 
 // round up power of 2, then get the order
@@ -335,3 +1038,91 @@ int get_order (uint32 v)
 
 }
 
+
+// fill in the allocator statistics for the kmemstat system call: the
+// free blocks of each order and, if built with CONFIG_KMEM_PROF, the
+// call site profile
+void kmem_stat (struct kmemstat *st)
+{
+    struct order *ord;
+    uint64 w, words;
+    int i;
+
+    memset(st, 0, sizeof(*st));
+
+    acquire(&kmem.lock);
+
+    st->free_bytes  = kmem.nfree;
+    st->total_bytes = kmem.total;
+
+    for (i = 0; (i < N_ORD) && (i < KMS_NORDER); i++) {
+        ord   = &kmem.orders[i];
+        words = (((kmem.end - kmem.base) >> (i + MIN_ORD)) + BM_BITS) >> BM_SHIFT;
+
+        for (w = 0; w < words; w++) {
+            st->nfree[i] += __builtin_popcountll(ord->bits[0][w]);
+        }
+    }
+
+    release(&kmem.lock);
+
+#ifdef CONFIG_KMEM_PROF
+    acquire(&kprof.lock);
+
+    st->profiling = 1;
+    st->dropped   = kprof.dropped;
+
+    for (i = 0; i < KMS_NSITE; i++) {
+        if (kprof.sites[i].pc != 0) {
+            st->sites[st->nsite++] = kprof.sites[i];
+        }
+    }
+
+    release(&kprof.lock);
+#endif
+}
+
+// print the magazine counters of all CPUs, one line per order
+void kmemdump (void)
+{
+    struct mag_stat sum;
+    struct mag_stat *st;
+    struct shrinker *sh;
+    uint64 allocs;
+    int i, ord;
+
+    cprintf("kmem: %d KB free (watermarks %d/%d KB), %d MB not yet populated\n",
+            (uint)(kmem.nfree >> 10), (uint)(kmem.wmark_low >> 10),
+            (uint)(kmem.wmark_high >> 10), (uint)(kmem.deferred >> 20));
+    cprintf("kmem: %d reclaims:", (uint)kmem.reclaims);
+
+    for (sh = kmem.shrinkers; sh != NULL; sh = sh->next) {
+        cprintf(" %s %d", sh->name, (uint)sh->released);
+    }
+
+    cprintf("\n");
+    cprintf("order   alloc-hit  alloc-miss  hit%%   free-hit   free-miss  refill  drain\n");
+
+    for (ord = MIN_ORD; ord <= MAG_MAX_ORD; ord++) {
+        memset(&sum, 0, sizeof(sum));
+
+        for (i = 0; i < NCPU; i++) {
+            st = &kmem_cpus[i].stats[ord - MIN_ORD];
+
+            sum.alloc_hit  += st->alloc_hit;
+            sum.alloc_miss += st->alloc_miss;
+            sum.free_hit   += st->free_hit;
+            sum.free_miss  += st->free_miss;
+            sum.refills    += st->refills;
+            sum.drains     += st->drains;
+        }
+
+        allocs = sum.alloc_hit + sum.alloc_miss;
+
+        cprintf("%d      %d  %d  %d  %d  %d  %d  %d\n", ord,
+                (uint)sum.alloc_hit, (uint)sum.alloc_miss,
+                allocs ? (uint)(sum.alloc_hit * 100 / allocs) : 0,
+                (uint)sum.free_hit, (uint)sum.free_miss,
+                (uint)sum.refills, (uint)sum.drains);
+    }
+}
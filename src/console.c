@@ -180,6 +180,14 @@ void consoleintr (int (*getc) (void))
             procdump();
             break;
 
+        case C('K'):  // Kernel memory allocator statistics.
+            kmemdump();
+            kmem_cache_dump();
+            zpool_dump();
+            pcache_dump();
+            thp_dump();
+            break;
+
         case C('U'):  // Kill line.
             while ((input.e != input.w) && (input.buf[(input.e - 1) % INPUT_BUF] != '\n')) {
                 input.e--;
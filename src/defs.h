@@ -14,11 +14,16 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kmem_cache;
+struct kmemstat;
 struct pipe;
 struct proc;
+struct shrinker;
 struct spinlock;
+struct shm;
 struct stat;
 struct superblock;
+struct vma;
 struct trapframe;
 
 typedef uint64	pte_t;
@@ -26,6 +31,8 @@ typedef uint64  pmd_t;
 typedef uint64  pgd_t;
 extern  uint64  _kernel_pgtbl;
 typedef void (*ISR) (struct trapframe *tf, int n);
+typedef int  (*pgtbl_leaf_fn) (pte_t *entry, int level, uint64 va, void *arg);
+typedef void (*pgtbl_table_fn) (pte_t *table, void *arg);
 
 // Proper variadic function call support that conforms to AAPCS64.
 typedef __builtin_va_list va_list;
@@ -58,8 +65,20 @@ void*           kmalloc (int order);
 void            kfree (void *mem, int order);
 void            free_page(void *v);
 void*           alloc_page (void);
+void*           alloc_pages (int order);
+void            free_pages (void *v, int order);
+void            split_pages (void *v, int order);
+void            get_page (void *v);
+int             page_count (void *v);
 void            kmem_test_b (void);
+void            kmem_bench (void);
+int             kmem_populate (void);
+void            register_shrinker (struct shrinker *sh);
+int             kmem_reclaim (int nr);
+int             kmem_balance (void);
+void            kmem_stat (struct kmemstat *st);
 int             get_order (uint32 v);
+void            kmemdump (void);
 
 // console.c
 void            consoleinit(void);
@@ -70,6 +89,10 @@ void            panic(char*) __attribute__((noreturn));
 
 // exec.c
 int             exec(char*, char**);
+int             execproc(struct proc*, char*, char**);
+
+// fdt.c
+void            fdt_meminit (uint64 dtb);
 
 // file.c
 struct file*    filealloc(void);
@@ -122,23 +145,41 @@ void            pic_init(void*);
 void            pic_dispatch (struct trapframe *tp);
 
 // pipe.c
+void            pipeinit(void);
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
+// pagenav.c
+int             pgtbl_walk(pgd_t *root, uint64 va, int level, int alloc, pte_t **entry_out);
+uint64          pgtbl_next(pgd_t *root, uint64 va);
+int             pgtbl_map_pages(pgd_t *root, uint64 start, uint64 end, uint64 phys_start, uint64 attrs);
+int             pgtbl_range(pgd_t *root, uint64 start, uint64 end, pgtbl_leaf_fn leaf,
+                            pgtbl_table_fn prune, void *arg);
+int             pgtbl_empty(pte_t *entry, int level);
+void            pgtbl_free(pgd_t *root);
+
+// pcache.c
+void            pcache_init (void);
+char*           pcache_get (struct inode *ip, uint off);
+void            pcache_add (struct inode *ip, uint off, char *page);
+void            pcache_forget (struct inode *ip);
+void            pcache_dump (void);
+
 //PAGEBREAK: 16
 // proc.c
 struct proc*    copyproc(struct proc*);
 void            exit(void);
 int             fork(void);
-int             growproc(int);
+int             growproc(long);
 int             kill(int);
 void            pinit(void);
 void            procdump(void);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
+int             spawn(char*, char**, struct file**);
 void            userinit(void);
 int             wait(void);
 void            wakeup(void*);
@@ -147,6 +188,27 @@ void            yield(void);
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// slab.c
+void            slab_init (void);
+struct kmem_cache* kmem_cache_create (char *name, uint size, void (*ctor)(void*));
+void*           kmem_cache_alloc (struct kmem_cache *c);
+void            kmem_cache_free (struct kmem_cache *c, void *obj);
+void            kmem_cache_dump (void);
+
+// zpool.c
+void            zpool_init (void);
+void*           alloc_zeroed_page (void);
+int             zpool_refill (void);
+void            zpool_dump (void);
+
+// shm.c
+void            shm_init (void);
+struct shm*     shm_get (int key, uint64 size);
+void            shm_dup (struct shm *s);
+void            shm_put (struct shm *s);
+uint64          shm_size (struct shm *s);
+char*           shm_page (struct shm *s, uint64 off);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 int             holding(struct spinlock*);
@@ -165,9 +227,9 @@ char*           strncpy(char*, const char*, int);
 // syscall.c
 int             argint(int, long*);
 int             argptr(int, char**, int);
-int             argstr(int, char**);
+int             argoutptr(int, char**, int);
+int             argstr(int, char*, int);
 int             fetchint(uint64, long*);
-int             fetchstr(uint64, char**);
 void            syscall(void);
 
 // timer.c
@@ -182,6 +244,12 @@ void            dump_trapframe (struct trapframe *tf);
 // trap_asm.S
 void            trap_reset(void);
 
+// uaccess.S
+int             copy_from_user(void *dst, uint64 src, uint64 n);
+int             copy_to_user(uint64 dst, void *src, uint64 n);
+int             strncpy_from_user(char *dst, uint64 src, uint64 n);
+int             touch_user(uint64 addr);
+
 // uart.c
 void 		_uart_putc(int c);                
 void 		_puts (char *s);
@@ -193,20 +261,38 @@ void            micro_delay(int us);
 void            uart_enable_rx();
 
 // vm.c
-int             allocuvm(pgd_t*, uint, uint);
-int             deallocuvm(pgd_t*, uint, uint);
+uint64          allocuvm(pgd_t*, uint64, uint64);
+uint64          deallocuvm(pgd_t*, uint64, uint64);
 void            freevm(pgd_t*);
 void            inituvm(pgd_t*, char*, uint);
-int             loaduvm(pgd_t*, char*, struct inode*, uint, uint);
-pmd_t*          copyuvm(pgd_t*, uint);
+pmd_t*          copyuvm(struct proc*);
 void            switchuvm(struct proc*);
-int             copyout(pgd_t*, uint, void*, uint);
+int             copyout(pgd_t*, uint64, void*, uint64);
 void            clearpteu(pgd_t *pgdir, char *uva);
 void*           kpt_alloc(void);
+void            kpt_free(char *v);
 void            init_vmm (void);
 void            kpt_freerange (uint64 low, uint64 hi);
+int             cowfault(pgd_t *pgdir, uint64 va);
+int             pagefault(struct proc *p, uint64 va, int write);
+int             writeuvm(struct proc *p, uint64 va);
+int             protuvm(pgd_t *pgdir, struct vma *v);
+void            syncuvm(pgd_t *pgdir, struct vma *v);
+void            ageuvm(struct proc *p);
+void            thp_stat (struct kmemstat *st);
+void            thp_dump (void);
 void            paging_init (uint64 phy_low, uint64 phy_hi);
 
+// vma.c
+void            vma_init (void);
+struct vma*     vma_find (struct vma *list, uint64 va);
+int             vma_add (struct vma **list, struct vma *tmpl);
+int             vma_dup (struct vma **dst, struct vma *src);
+void            vma_free (struct vma **list, pgd_t *pgdir);
+uint64          mmap (uint64 addr, uint64 len, int prot, int flags, struct file *f, uint64 off);
+int             munmap (uint64 addr, uint64 len);
+int             mprotect (uint64 addr, uint64 len, int prot);
+
 // gic.c
 void 		gic_init(void* base);
 
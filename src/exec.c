@@ -4,13 +4,15 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "fs.h"
+#include "file.h"
 #include "elf.h"
 #include "arm.h"
+#include "mman.h"
 
-extern uint64 llvaddr;
-
-// load a user program for execution
-int exec (char *path, char **argv)
+// load a user program into p, replacing its image (if any). p is the
+// current process for exec, or a new one that spawn has yet to start.
+int execproc (struct proc *p, char *path, char **argv)
 {
     struct elfhdr elf;
     struct inode *ip;
@@ -25,6 +27,9 @@ int exec (char *path, char **argv)
     uint64 sz;
     uint64 sp;
     uint64 ustack[3 + MAXARG + 1];
+    struct vma *vmas;
+    struct vma *oldvmas;
+    struct vma v;
 
 #ifdef CONFIG_DEBUG
     struct secthdr sh;
@@ -40,6 +45,7 @@ int exec (char *path, char **argv)
 
     ilock(ip);
     pgdir = 0;
+    vmas = 0;
 
     // Check ELF header
     if (readi(ip, (char*) &elf, 0, sizeof(elf)) < sizeof(elf)) {
@@ -54,9 +60,11 @@ int exec (char *path, char **argv)
         goto bad;
     }
 
-    // Load program into memory.
+    // Map the program. Nothing is read yet: each segment becomes a
+    // private file mapping, and pagefault loads a page from the file
+    // when it is first touched.
     sz = 0;
-    
+
     for (i = 0, off = elf.phoff; i < elf.phnum; i++, off += sizeof(ph)) {
         if (readi(ip, (char*) &ph, off, sizeof(ph)) != sizeof(ph)) {
             goto bad;
@@ -66,17 +74,43 @@ int exec (char *path, char **argv)
             continue;
         }
 
-        if (ph.memsz < ph.filesz) {
+        // below the mmap area and within the file, without the sums
+        // wrapping around
+        if ((ph.memsz < ph.filesz) || (ph.vaddr >= UMMAP_BASE) ||
+            (ph.memsz >= UMMAP_BASE - ph.vaddr) ||
+            (ph.filesz > ip->size) || (ph.off > ip->size - ph.filesz)) {
             goto bad;
         }
 
-        if ((sz = allocuvm(pgdir, sz, ph.vaddr + ph.memsz)) == 0) {
+        // segments come in address order and must not share a page
+        if (align_dn(ph.vaddr, PTE_SZ) < align_up(sz, PTE_SZ)) {
             goto bad;
         }
 
-        if (loaduvm(pgdir, (char*) ph.vaddr, ip, ph.off, ph.filesz) < 0) {
+        memset(&v, 0, sizeof(v));
+        v.start = align_dn(ph.vaddr, PTE_SZ);
+        v.end = align_up(ph.vaddr + ph.memsz, PTE_SZ);
+        v.prot = PROT_READ;
+        v.maxprot = PROT_READ | PROT_WRITE | PROT_EXEC;
+        v.flags = MAP_PRIVATE;
+        v.ip = ip;
+        v.fstart = ph.vaddr;
+        v.fend = ph.vaddr + ph.filesz;
+        v.off = ph.off;
+
+        if (ph.flags & ELF_PROG_FLAG_WRITE) {
+            v.prot |= PROT_WRITE;
+        }
+
+        if (ph.flags & ELF_PROG_FLAG_EXEC) {
+            v.prot |= PROT_EXEC;
+        }
+
+        if (vma_add(&vmas, &v) < 0) {
             goto bad;
         }
+
+        sz = ph.vaddr + ph.memsz;
     }
 
 #ifdef CONFIG_DEBUG
@@ -116,7 +150,7 @@ int exec (char *path, char **argv)
 	}
 
 	if (sh.name == strndx) {
-	       cprintf("exec: loaded %s @ 0x%p [|.text| %db]\n", path, llvaddr, sh.sz);
+	       cprintf("exec: mapped %s, .text @ 0x%p [|.text| %db]\n", path, sh.addr, sh.sz);
 	       break;
 	}
     }
@@ -156,8 +190,8 @@ int exec (char *path, char **argv)
     ustack[argc] = 0;
 
     // in ARM, parameters are passed in r0 and r1
-    proc->tf->r0 = argc;
-    proc->tf->r1 = sp - (argc + 1) * 8;
+    p->tf->r0 = argc;
+    p->tf->r1 = sp - (argc + 1) * 8;
 
     sp -= (argc + 1) * 8;
 
@@ -172,17 +206,33 @@ int exec (char *path, char **argv)
         }
     }
 
-    safestrcpy(proc->name, last, sizeof(proc->name));
+    safestrcpy(p->name, last, sizeof(p->name));
 
     // Commit to the user image.
-    oldpgdir = proc->pgdir;
-    proc->pgdir = pgdir;
-    proc->sz = sz;
-    proc->tf->elr = elf.entry;
-    proc->tf->sp = sp;
-
-    switchuvm(proc);
-    freevm(oldpgdir);
+    oldvmas = p->vmas;
+    p->vmas = vmas;
+
+    oldpgdir = p->pgdir;
+    p->pgdir = pgdir;
+    p->sz = sz;
+    p->tf->elr = elf.entry;
+    p->tf->sp = sp;
+
+    // a new address space needs a new ASID. The old one is not handed
+    // out again before the TLB is flushed, so its entries can stay.
+    p->asid = 0;
+
+    if (p == proc) {
+        switchuvm(p);
+    }
+
+    // shared file mappings are written back before their pages go
+    vma_free(&oldvmas, oldpgdir);
+
+    if (oldpgdir) {
+        freevm(oldpgdir);
+    }
+
     return 0;
 
     bad: if (pgdir) {
@@ -192,5 +242,13 @@ int exec (char *path, char **argv)
     if (ip) {
         iunlockput(ip);
     }
+
+    vma_free(&vmas, 0);
     return -1;
 }
+
+// load a user program for execution
+int exec (char *path, char **argv)
+{
+    return execproc(proc, path, argv);
+}
@@ -0,0 +1,228 @@
+// Memory discovery from the flattened device tree
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "arm.h"
+#include "memlayout.h"
+#include "mmu.h"
+
+// The boot loader passes the physical address of the device tree blob
+// (DTB) in x0. QEMU does not do so for an ELF kernel, but places the DTB
+// at the start of RAM, below the kernel. We only need the memory banks
+// (/memory nodes) and the reserved regions (the memory reservation block
+// and the children of /reserved-memory), so instead of pulling in libfdt
+// this walks the structure block directly. The DTB must lie within the
+// memory mapped at boot (INIT_KERN_SZ); without one, or with a bad one,
+// the fixed PHY_START..PHYSTOP range of the board is used.
+
+#define FDT_MAGIC       0xd00dfeed
+#define FDT_BEGIN_NODE  1
+#define FDT_END_NODE    2
+#define FDT_PROP        3
+#define FDT_NOP         4
+#define FDT_END         9
+
+#define FDT_MAX_DEPTH   8
+
+struct fdt_header {
+    uint32  magic;
+    uint32  totalsize;
+    uint32  off_dt_struct;
+    uint32  off_dt_strings;
+    uint32  off_mem_rsvmap;
+    uint32  version;
+    uint32  last_comp_version;
+    uint32  boot_cpuid_phys;
+    uint32  size_dt_strings;
+    uint32  size_dt_struct;
+};
+
+struct meminfo meminfo;
+
+static inline uint32 be32 (void *p)
+{
+    return __builtin_bswap32(*(uint32*)p);
+}
+
+// read a number of 1 or 2 cells
+static uint64 fdt_cells (uint32 *p, int n)
+{
+    return (n == 2) ? (((uint64)be32(p) << 32) | be32(p + 1)) : be32(p);
+}
+
+// add [start, start+size) to a range table, kept sorted by address
+static void add_memrange (struct memrange *tbl, int *cnt, int max, uint64 start, uint64 size)
+{
+    int i;
+
+    // the kernel can only reach memory through its linear map
+    if ((size == 0) || (start >= MAX_PHYS_ADDR)) {
+        return;
+    }
+
+    if (start + size > MAX_PHYS_ADDR) {
+        size = MAX_PHYS_ADDR - start;
+    }
+
+    if (*cnt == max) {
+        _puts("fdt: too many memory ranges, ignoring some\n");
+        return;
+    }
+
+    for (i = *cnt; (i > 0) && (tbl[i - 1].start > start); i--) {
+        tbl[i] = tbl[i - 1];
+    }
+
+    tbl[i].start = start;
+    tbl[i].end   = start + size;
+    (*cnt)++;
+}
+
+// decode a reg property as a list of (address, size) pairs
+static void add_reg (struct memrange *tbl, int *cnt, int max,
+                     uint32 *p, uint32 len, int acells, int scells)
+{
+    uint32 n;
+
+    if ((acells < 1) || (acells > 2) || (scells < 1) || (scells > 2)) {
+        return;
+    }
+
+    for (n = len / 4; n >= acells + scells; n -= acells + scells) {
+        add_memrange(tbl, cnt, max, fdt_cells(p, acells), fdt_cells(p + acells, scells));
+        p += acells + scells;
+    }
+}
+
+static int fdt_parse (struct fdt_header *fdt)
+{
+    uint32  *p, *end;
+    char    *strs, *name;
+    char    *names[FDT_MAX_DEPTH];
+    int     acells[FDT_MAX_DEPTH], scells[FDT_MAX_DEPTH];
+    uint32  len;
+    uint64  addr, size;
+    int     depth;
+
+    if ((be32(&fdt->magic) != FDT_MAGIC) || (be32(&fdt->last_comp_version) > 17)) {
+        return -1;
+    }
+
+    // the memory reservation block, (address, size) pairs up to (0, 0)
+    for (p = (uint32*)((char*)fdt + be32(&fdt->off_mem_rsvmap)); ; p += 4) {
+        addr = fdt_cells(p, 2);
+        size = fdt_cells(p + 2, 2);
+
+        if ((addr == 0) && (size == 0)) {
+            break;
+        }
+
+        add_memrange(meminfo.resv, &meminfo.nresv, NMEMRESV, addr, size);
+    }
+
+    p     = (uint32*)((char*)fdt + be32(&fdt->off_dt_struct));
+    end   = (uint32*)((char*)p + be32(&fdt->size_dt_struct));
+    strs  = (char*)fdt + be32(&fdt->off_dt_strings);
+    depth = -1;
+
+    while (p < end) {
+        switch (be32(p++)) {
+        case FDT_BEGIN_NODE:
+            name = (char*)p;
+            p += (strlen(name) + 4) / 4;
+
+            if (++depth == FDT_MAX_DEPTH) {
+                return -1;
+            }
+
+            // defaults for the children of this node
+            names[depth]  = name;
+            acells[depth] = 2;
+            scells[depth] = 1;
+            break;
+
+        case FDT_END_NODE:
+            if (depth-- < 0) {
+                return -1;
+            }
+            break;
+
+        case FDT_PROP:
+            len  = be32(p);
+            name = strs + be32(p + 1);
+            p   += 2;
+
+            // properties of a node precede its children, so the cells of
+            // the parent are known when a reg property is seen
+            if (depth < 0) {
+                return -1;
+
+            } else if (strncmp(name, "#address-cells", 15) == 0) {
+                acells[depth] = be32(p);
+
+            } else if (strncmp(name, "#size-cells", 12) == 0) {
+                scells[depth] = be32(p);
+
+            } else if ((strncmp(name, "reg", 4) == 0) && (depth >= 1)) {
+                if ((depth == 1) && (strncmp(names[1], "memory", 6) == 0) &&
+                    (names[1][6] == '\0' || names[1][6] == '@')) {
+                    add_reg(meminfo.bank, &meminfo.nbank, NMEMBANK, p, len,
+                            acells[0], scells[0]);
+
+                } else if ((depth == 2) && (strncmp(names[1], "reserved-memory", 16) == 0)) {
+                    add_reg(meminfo.resv, &meminfo.nresv, NMEMRESV, p, len,
+                            acells[1], scells[1]);
+                }
+            }
+
+            p += (len + 3) / 4;
+            break;
+
+        case FDT_NOP:
+            break;
+
+        case FDT_END:
+            return (meminfo.nbank > 0) ? 0 : -1;
+
+        default:
+            return -1;
+        }
+    }
+
+    return -1;
+}
+
+// find the RAM banks and the reserved memory of the machine, dtb is the
+// physical address of the DTB handed over by the boot loader (or 0)
+void fdt_meminit (uint64 dtb)
+{
+    struct fdt_header *fdt;
+    int i;
+
+    if (dtb == 0) {
+        dtb = PHY_START;
+    }
+
+    fdt = p2v(dtb);
+    memset(&meminfo, 0, sizeof(meminfo));
+
+    if ((dtb < PHY_START) || (dtb + sizeof(*fdt) > INIT_KERNMAP) ||
+        (dtb + be32(&fdt->totalsize) > INIT_KERNMAP) ||
+        (fdt_parse(fdt) < 0) || (meminfo.bank[0].start > INIT_KERNMAP) ||
+        (meminfo.bank[0].end <= INIT_KERNMAP)) {
+        _puts("fdt: no usable device tree, assuming a fixed memory size\n");
+
+        memset(&meminfo, 0, sizeof(meminfo));
+        add_memrange(meminfo.bank, &meminfo.nbank, NMEMBANK, PHY_START, PHYSTOP - PHY_START);
+    }
+
+    for (i = 0; i < meminfo.nbank; i++) {
+        _putint("fdt: memory ", (uint)meminfo.bank[i].start, "");
+        _putint(" - ", (uint)(meminfo.bank[i].end - 1), "\n");
+    }
+
+    for (i = 0; i < meminfo.nresv; i++) {
+        _putint("fdt: reserved ", (uint)meminfo.resv[i].start, "");
+        _putint(" - ", (uint)(meminfo.resv[i].end - 1), "\n");
+    }
+}
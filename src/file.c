@@ -10,14 +10,21 @@
 #include "spinlock.h"
 
 struct devsw devsw[NDEV];
+
+// File structures come from a slab cache; ftable.lock protects
+// the reference counts.
 struct {
     struct spinlock lock;
-    struct file file[NFILE];
+    struct kmem_cache *cache;
 } ftable;
 
 void fileinit (void)
 {
     initlock(&ftable.lock, "ftable");
+
+    if ((ftable.cache = kmem_cache_create("file", sizeof(struct file), 0)) == NULL) {
+        panic("fileinit: file cache");
+    }
 }
 
 // Allocate a file structure.
@@ -25,18 +32,14 @@ struct file* filealloc (void)
 {
     struct file *f;
 
-    acquire(&ftable.lock);
-
-    for (f = ftable.file; f < ftable.file + NFILE; f++) {
-        if (f->ref == 0) {
-            f->ref = 1;
-            release(&ftable.lock);
-            return f;
-        }
+    if ((f = kmem_cache_alloc(ftable.cache)) == 0) {
+        return 0;
     }
 
-    release(&ftable.lock);
-    return 0;
+    memset(f, 0, sizeof(*f));
+    f->ref = 1;
+
+    return f;
 }
 
 // Increment ref count for file f.
@@ -70,10 +73,10 @@ void fileclose (struct file *f)
     }
 
     ff = *f;
-    f->ref = 0;
-    f->type = FD_NONE;
     release(&ftable.lock);
 
+    kmem_cache_free(ftable.cache, f);
+
     if (ff.type == FD_PIPE) {
         pipeclose(ff.pipe, ff.writable);
 
@@ -81,6 +84,9 @@ void fileclose (struct file *f)
         begin_trans();
         iput(ff.ip);
         commit_trans();
+
+    } else if (ff.type == FD_SHM) {
+        shm_put(ff.shm);
     }
 }
 
@@ -1,10 +1,11 @@
 struct file {
-    enum { FD_NONE, FD_PIPE, FD_INODE } type;
+    enum { FD_NONE, FD_PIPE, FD_INODE, FD_SHM } type;
     int          ref;   // reference count
     char         readable;
     char         writable;
     struct pipe  *pipe;
     struct inode *ip;
+    struct shm   *shm;  // FD_SHM, see shm.c
     uint         off;
 };
 
@@ -22,6 +23,9 @@ struct inode {
     short   nlink;
     uint    size;
     uint    addrs[NDIRECT+1];
+
+    struct inode *next; // i-node cache list, see fs.c
+    struct inode *prev;
 };
 #define I_BUSY 0x1
 #define I_VALID 0x2
@@ -18,6 +18,7 @@
 #include "spinlock.h"
 #include "buf.h"
 #include "fs.h"
+#include "shrinker.h"
 #include "file.h"
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
@@ -159,15 +160,90 @@ static void bfree (int dev, uint b)
 // Many internal file system functions expect the caller to
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
+//
+// The cache grows on demand: entries come from a slab cache and
+// are kept on a list, most recently released first. An entry whose
+// ref has fallen to zero stays cached (and valid), so the next
+// iget of the same inode skips the disk read. At most NINODE such
+// unreferenced entries are kept; beyond that the least recently
+// released ones are given back to the slab cache.
 
 struct {
     struct spinlock lock;
-    struct inode inode[NINODE];
+    struct kmem_cache *cache;
+    struct inode head;      // head.next is the most recently released
+    int nunused;            // # of cached entries with ref == 0
 } icache;
 
+static int icache_shrink (int nr);
+
+static struct shrinker icache_shrinker = {
+    .name   = "icache",
+    .shrink = icache_shrink,
+};
+
 void iinit (void)
 {
     initlock(&icache.lock, "icache");
+
+    icache.head.next = &icache.head;
+    icache.head.prev = &icache.head;
+
+    if ((icache.cache = kmem_cache_create("inode", sizeof(struct inode), 0)) == NULL) {
+        panic("iinit: inode cache");
+    }
+
+    register_shrinker(&icache_shrinker);
+}
+
+static void icache_unlink (struct inode *ip)
+{
+    ip->next->prev = ip->prev;
+    ip->prev->next = ip->next;
+}
+
+static void icache_push (struct inode *ip)
+{
+    ip->next = icache.head.next;
+    ip->prev = &icache.head;
+    icache.head.next->prev = ip;
+    icache.head.next = ip;
+}
+
+// Give back up to n unreferenced entries, least recently released
+// first. Returns the number of entries freed. icache.lock must be held.
+static int icache_evict (int n)
+{
+    struct inode *ip, *prev;
+    int freed;
+
+    freed = 0;
+
+    for (ip = icache.head.prev; ip != &icache.head && freed < n; ip = prev) {
+        prev = ip->prev;
+
+        if (ip->ref == 0) {
+            icache_unlink(ip);
+            kmem_cache_free(icache.cache, ip);
+            icache.nunused--;
+            freed++;
+        }
+    }
+
+    return freed;
+}
+
+// under memory pressure: free the unreferenced entries, about nr pages
+// worth of them (the pages return to the allocator with the slabs)
+static int icache_shrink (int nr)
+{
+    int freed;
+
+    acquire(&icache.lock);
+    freed = icache_evict(nr * (PTE_SZ / sizeof(struct inode)));
+    release(&icache.lock);
+
+    return freed;
 }
 
 static struct inode* iget (uint dev, uint inum);
@@ -227,35 +303,33 @@ void iupdate (struct inode *ip)
 // the inode and does not read it from disk.
 static struct inode* iget (uint dev, uint inum)
 {
-    struct inode *ip, *empty;
+    struct inode *ip;
 
     acquire(&icache.lock);
 
     // Is the inode already cached?
-    empty = 0;
+    for (ip = icache.head.next; ip != &icache.head; ip = ip->next) {
+        if (ip->dev == dev && ip->inum == inum) {
+            if (ip->ref++ == 0) {
+                icache.nunused--;
+            }
 
-    for (ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++) {
-        if (ip->ref > 0 && ip->dev == dev && ip->inum == inum) {
-            ip->ref++;
             release(&icache.lock);
             return ip;
         }
-
-        if (empty == 0 && ip->ref == 0) {   // Remember empty slot.
-            empty = ip;
-        }
     }
 
-    // Recycle an inode cache entry.
-    if (empty == 0) {
+    // Allocate a new cache entry.
+    if ((ip = kmem_cache_alloc(icache.cache)) == 0) {
         panic("iget: no inodes");
     }
 
-    ip = empty;
+    memset(ip, 0, sizeof(*ip));
     ip->dev = dev;
     ip->inum = inum;
     ip->ref = 1;
     ip->flags = 0;
+    icache_push(ip);
     release(&icache.lock);
 
     return ip;
@@ -349,7 +423,15 @@ void iput (struct inode *ip)
         wakeup(ip);
     }
 
-    ip->ref--;
+    if (--ip->ref == 0) {
+        icache_unlink(ip);
+        icache_push(ip);
+
+        if (++icache.nunused > NINODE) {
+            icache_evict(icache.nunused - NINODE);
+        }
+    }
+
     release(&icache.lock);
 }
 
@@ -417,6 +499,8 @@ static void itrunc (struct inode *ip)
     struct buf *bp;
     uint *a;
 
+    pcache_forget(ip);
+
     for (i = 0; i < NDIRECT; i++) {
         if (ip->addrs[i]) {
             bfree(ip->dev, ip->addrs[i]);
@@ -509,6 +593,9 @@ int writei (struct inode *ip, char *src, uint off, uint n)
         return -1;
     }
 
+    // programs running from this file keep the pages they have
+    pcache_forget(ip);
+
     for (tot = 0; tot < n; tot += m, off += m, src += m) {
         bp = bread(ip->dev, bmap(ip, off / BSIZE));
         m = min(n - tot, BSIZE - off%BSIZE);
@@ -3,9 +3,9 @@
 // Licensed under the Apache License, Version 2.0 (the "License");
 // you may not use this file except in compliance with the License.
 // You may obtain a copy of the License at
-// 
+//
 //     http://www.apache.org/licenses/LICENSE-2.0
-// 
+//
 // Unless required by applicable law or agreed to in writing, software
 // distributed under the License is distributed on an "AS IS" BASIS,
 // WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
@@ -13,107 +13,202 @@
 // limitations under the License.
 //
 
-#include "sysreg.h"
-#include "page.h"
+/* The page table walker. The layout of the tables - the granule, and so
+   how many levels there are and how many address bits each resolves -
+   is fixed at build time by mmu.h; nothing here knows about a particular
+   one. User and kernel tables may start at different levels, which the
+   address tells apart (PT_TOP_LEVEL). vm.c does all of its page table
+   navigation through these. Tables come from kpt_alloc and go back with
+   kpt_free. */
+
+#include "types.h"
+#include "defs.h"
+#include "memlayout.h"
+#include "mmu.h"
+
+/* Walk the page table at `root` for `va`, down to level `level`. Missing
+   tables on the way are allocated if `alloc` is set. If `va` lies in a
+   block above `level` (e.g. the kernel linear map, see paging_init, or a
+   huge page), the walk stops there. The entry is returned in `entry_out`,
+   whatever it holds; the return value is its level, or -1 if a table is
+   missing or cannot be allocated. */
+int pgtbl_walk(pgd_t *root, uint64 va, int level, int alloc, pte_t **entry_out) {
+    pte_t *table = root;
+    pte_t *entry;
+    int lvl;
+
+    for (lvl = PT_TOP_LEVEL(va); ; lvl++) {
+        entry = &table[PT_IDX(va, lvl)];
+
+        /* A block descriptor maps va: nothing below it to walk */
+        if (lvl == level || ENTRY_IS_BLOCK(*entry))
+            break;
+
+        if (*entry & ENTRY_VALID) {
+            /* Extract the next level from the entry - the entries are physical addresses */
+            table = p2v(*entry & PG_ADDR_MASK);
+            continue;
+        }
 
-void init_pgtbl_constants(void) {
-    int i;
+        if (!alloc || (table = kpt_alloc()) == NULL)
+            return -1;
 
-    for (i = _PT_N_MAX; i > -1; i--) {
-        PT_LEVEL_ADDR_SHIFT[i] = _PT_PS + i * (_PT_PS - 3);
-        PT_LEVEL_PTRS[i]       = 1 << (_PT_PS - 3);
-        PT_LEVEL_MASK[i]       = ((va_t)PT_LEVEL_PTRS[i] - 1) << PT_LEVEL_ADDR_SHIFT[i];
+        /* The permissions here are overly generous, but they can be
+           further restricted by the permissions in the page table
+           entries, if necessary. */
+        *entry = v2p(table) | ENTRY_TABLE | ENTRY_VALID;
     }
 
-    for (i = _PT_N_MAX; i < 5; i++) {
-        PT_LEVEL_ADDR_SHIFT[i] = 0;
-        PT_LEVEL_PTRS[i]       = 0;
-        PT_LEVEL_MASK[i]       = 0;
-    }
+    *entry_out = entry;
+    return lvl;
 }
 
-inline unsigned int pgtbl_level_idx(va_t va, int lvl) {
-    return ((va & PT_LEVEL_MASK[lvl]) >> PT_LEVEL_ADDR_SHIFT[lvl]);
+/* The first address above `va` that may be mapped in `root`: the end of
+   the page or block that holds `va`, or of the range a missing table would
+   map. Loops over a sparse range of user space step with this, to pass
+   over what is not there in one go. */
+uint64 pgtbl_next(pgd_t *root, uint64 va) {
+    pte_t *table = root;
+    pte_t *entry;
+    int lvl;
+
+    for (lvl = PT_TOP_LEVEL(va); lvl < 3; lvl++) {
+        entry = &table[PT_IDX(va, lvl)];
+
+        if ((*entry & ENTRY_MASK) != (ENTRY_TABLE | ENTRY_VALID))
+            break;
+
+        table = p2v(*entry & PG_ADDR_MASK);
+    }
+
+    return align_up(va + 1, 1ULL << PT_LEVEL_SHIFT(lvl));
 }
 
-/* Walk the page table at `base`. Do not apply attributes to the entry, aside from
-   those necessary for navigation. Use pgtbl_map_pages to actually perform a "proper"
-   mapping. */
-int pgtbl_walk(pgtbl_desc_t *base, va_t va, pgtbl_desc_t **entry_out, int alloc) {
-    pgtbl_desc_t *next_desc = base;
-    pgtbl_desc_t *alloc_target;
-    int i = 0;
-    unsigned long long int mask;
-
-    while ((mask = PT_LEVEL_MASK[i++]))
-    {
-        /* Move to the correct descriptor */
-        next_desc = next_desc[pgtbl_level_idx(va, i)];
-
-        /* Fail on block descriptors for now */
-        if (*next_desc & (ENTRY_VALID | ENTRY_TABLE) == ENTRY_VALID) {
-            kern_print_warn("Block descriptors not supported.");
+/* Map the pages [start, end) to the physically contiguous memory from
+   `phys_start`, with descriptor bits `attrs`. All addresses must be page
+   aligned. The walk from the root is done once per last level table,
+   whose entries are then filled in a row. Returns -1 if a table cannot
+   be allocated; mapping a page twice is a bug. */
+int pgtbl_map_pages(pgd_t *root, uint64 start, uint64 end, uint64 phys_start, uint64 attrs) {
+    uint64 vpage_base = start;
+    uint64 ppage_base = phys_start;
+    uint64 table_end;
+    pte_t *pgtbl_entry;
+    int lvl;
+
+    while (vpage_base < end) {
+        if ((lvl = pgtbl_walk(root, vpage_base, 3, 1, &pgtbl_entry)) < 0)
             return -1;
-        }
 
-        /* Check that the descriptor is valid */
-        if (!(*next_desc & ENTRY_VALID)) {
-            if (!alloc)
-                return -1;
+        /* A block above the page, which is mapped already */
+        if (lvl != 3)
+            panic("remap");
 
-            /* Should probably treat this as a more serious failure. */
-            if ((alloc_target = page_alloc()) < 0)
-                return -1;
+        table_end = align_dn(vpage_base, 1ULL << PT_LEVEL_SHIFT(2)) + (1ULL << PT_LEVEL_SHIFT(2));
 
-            memset(alloc_target, 0, PAGE_SIZE);
+        for (; (vpage_base < end) && (vpage_base < table_end); pgtbl_entry++) {
+            if (*pgtbl_entry & ENTRY_VALID)
+                panic("remap");
 
-            /* Note that ENTRY_TABLE is being set for tables and page descriptors alike - they present the same in memory. */
-            *next_desc = kern_v2p(alloc_target) | ENTRY_VALID | ENTRY_TABLE;
+            *pgtbl_entry = ppage_base | attrs | ENTRY_PAGE | ENTRY_VALID;
+            vpage_base += PTE_SZ;
+            ppage_base += PTE_SZ;
+        }
+    }
 
-            next_desc = alloc_target;
+    return 0;
+}
 
-        } else {
-            /* Extract the next level from the entry - the entries are physical addresses */
-            next_desc = kern_p2v(*next_desc & mask);
+/* The part of a range walk below one table: `table`, of level `level`,
+   maps [start, end). See pgtbl_range. */
+static int pgtbl_range_level(pte_t *table, int level, uint64 start, uint64 end,
+                             pgtbl_leaf_fn leaf, pgtbl_table_fn prune, void *arg) {
+    uint64 size = 1ULL << PT_LEVEL_SHIFT(level);
+    uint64 va, next;
+    pte_t *entry, *child;
+    int ret;
+
+    for (va = start; va < end; va = next) {
+        next = align_dn(va, size) + size;
+        entry = &table[PT_IDX(va, level)];
+
+        if (!(*entry & ENTRY_VALID))
+            continue;
+
+        if ((level == 3) || ENTRY_IS_BLOCK(*entry)) {
+            if ((ret = leaf(entry, level, align_dn(va, size), arg)) < 0)
+                return ret;
+
+            /* Unless the block was split into a table, to take a part */
+            if ((level == 3) || ((*entry & ENTRY_MASK) != (ENTRY_TABLE | ENTRY_VALID)))
+                continue;
+        }
+
+        child = p2v(*entry & PG_ADDR_MASK);
+        ret = pgtbl_range_level(child, level + 1, va, (next < end) ? next : end, leaf, prune, arg);
+
+        if (ret < 0)
+            return ret;
+
+        if (prune && pgtbl_empty(entry, level)) {
+            *entry = 0;
+            prune(child, arg);
         }
     }
 
-    *entry_out = next_desc;
     return 0;
 }
 
-/* Maps a physically contiguous block of memory from `phys_start`, over a length of end - start
-   (end is exclusive). All addresses should be page-aligned. */
-int pgtbl_map_pages(pgtbl_desc_t *base, va_t start, va_t end, pa_t phys_start, pgtbl_attrs_t attrs, int mode) {
-    va_t vpage_base = start;
-    pa_t ppage_base = phys_start;
-    pgtbl_desc_t *pgtbl_entry;
-    unsigned long long int mode_attr;
-
-    KASSERT(mode >= 0 && mode < MEMATTR_MAX_IDX, 
-        ("pgtbl_map_pages: memory mode %d out of range", mode));
-    KASSERT(start == ALIGN_DOWN(start, _PT_PS),
-        ("pgtbl_map_pages: start va not page aligned: 0x%llx", start));
-    KASSERT(end == ALIGN_DOWN(end, _PT_PS),
-        ("pgtbl_map_pages: end va not page aligned: 0x%llx", end));
-    KASSERT(phys_start == ALIGN_DOWN(phys_start, _PT_PS),
-        ("pgtbl_map_pages: phys_start pa not page aligned: 0x%llx", phys_start));
-
-    while (vpage_base + PAGE_SIZE < end) {
-        if (pgtbl_walk(base, vpage_base, &pgtbl_entry, 1) < 0)
-            return -1;
+/* Walk the user range [start, end) of the page table at `root`, visiting
+   only the tables that are there: `leaf` is called for every valid page
+   or block that overlaps the range, with the address it maps from. It may
+   change the entry, or split a block into a table (which is then walked
+   in turn); a negative return ends the walk, and is returned. If `prune`
+   is given, tables left empty below the root are unlinked and given to
+   it, to be freed once no TLB walk can reach them. */
+int pgtbl_range(pgd_t *root, uint64 start, uint64 end,
+                pgtbl_leaf_fn leaf, pgtbl_table_fn prune, void *arg) {
+    return pgtbl_range_level(root, PT_TOP_LEVEL(start), start, end, leaf, prune, arg);
+}
 
-        if (*pgtbl_entry & ENTRY_VALID)
-            return -1;
+/* Is nothing mapped through `entry`, an entry of level `level`: it is
+   invalid, or a table with no valid entries. */
+int pgtbl_empty(pte_t *entry, int level) {
+    pte_t *table;
+    int i;
+
+    if (!(*entry & ENTRY_VALID))
+        return 1;
 
-        mode_attr = (mode & 7) << PT_DESC_STAGE1_LOWER_MEMATTR_SHIFT;
+    if (level == 3 || ENTRY_IS_BLOCK(*entry))
+        return 0;
 
-        /* XXX: Should mask attrs application to ensure it doesn't write over address bits. */
-        *pgtbl_entry = ppage_base | attrs | ENTRY_VALID | ENTRY_TABLE | mode_attr;
+    table = p2v(*entry & PG_ADDR_MASK);
 
-        vpage_base += PAGE_SIZE;
-        ppage_base += PAGE_SIZE;
+    /* Only a top level table is short, and it has no parent */
+    for (i = 0; i < PTRS_PER_PTE; i++) {
+        if (table[i] & ENTRY_VALID)
+            return 0;
     }
 
-    return 0;
-}
\ No newline at end of file
+    return 1;
+}
+
+static void pgtbl_free_level(pte_t *table, int level, int nptrs) {
+    int i;
+
+    if (level < 3) {
+        for (i = 0; i < nptrs; i++) {
+            if ((table[i] & ENTRY_MASK) == (ENTRY_TABLE | ENTRY_VALID))
+                pgtbl_free_level(p2v(table[i] & PG_ADDR_MASK), level + 1, PTRS_PER_PTE);
+        }
+    }
+
+    kpt_free((char*) table);
+}
+
+/* Free the user page table at `root` and all the tables below it, but not
+   the memory they map (see freevm). */
+void pgtbl_free(pgd_t *root) {
+    pgtbl_free_level(root, UPT_TOP_LEVEL, PT_TOP_PTRS(UVA_BITS));
+}
@@ -0,0 +1,30 @@
+// Kernel memory statistics, returned by the kmemstat system call
+
+#define KMS_MIN_ORDER   6       // smallest block of the buddy allocator
+#define KMS_NORDER      20      // orders 6 (64B) .. 25 (32MB), see MAX_ALLOC_SHIFT
+#define KMS_NSITE       64      // call sites tracked
+
+// one caller of kmalloc/kfree (or of alloc_page(s)/free_page(s))
+struct kmemsite {
+    uint64  pc;                 // return address into the caller
+    uint64  allocs;
+    uint64  alloc_bytes;
+    uint64  frees;
+    uint64  free_bytes;
+};
+
+struct kmemstat {
+    uint64  free_bytes;         // in the buddy lists
+    uint64  total_bytes;        // managed by the allocator
+    uint64  nfree[KMS_NORDER];  // free blocks of each order
+
+    uint64  thp_mapped;         // level 2 blocks mapped for user memory
+    uint64  thp_allocs;
+    uint64  thp_splits;         // blocks split back into pages
+    uint64  thp_fallbacks;      // faults that found no free block
+
+    int     profiling;          // sites[] filled in (CONFIG_KMEM_PROF)
+    int     nsite;
+    uint64  dropped;            // calls from sites that did not fit
+    struct kmemsite sites[KMS_NSITE];
+};
@@ -14,10 +14,10 @@ struct cpu	*cpu;
 
 #define MB (1024*1024)
 
-void kmain (void)
+void kmain (uint64 dtb)
 {
-    uint64 mpidr;
-    int cpu_id;
+    uint64 mpidr, lo;
+    int cpu_id, i;
      
     // If we're on a uniprocessor system, just use &cpus[0].
     // Otherwise, generating a linear sequential CPU ID based on MPIDR_EL1.{Aff3..Aff0}
@@ -41,13 +41,27 @@ void kmain (void)
     uart_init (P2V(UART0));
     _puts("kmain: uart_init complete\n");
 
+    fdt_meminit (dtb);				// RAM banks from the device tree
+
     init_vmm ();
     kpt_freerange (align_up(&end, PT_SZ), P2V_WO(INIT_KERNMAP));
-    paging_init (INIT_KERNMAP, PHYSTOP);
+
+    // map the RAM above the kernel
+    for (i = 0; i < meminfo.nbank; i++) {
+        lo = (meminfo.bank[i].start < INIT_KERNMAP) ? INIT_KERNMAP : meminfo.bank[i].start;
+
+        if (lo < meminfo.bank[i].end) {
+            paging_init(lo, meminfo.bank[i].end);
+        }
+    }
+
     _puts("kmain: paging_init complete\n");
 
     kmem_init ();
-    kmem_init2(P2V(INIT_KERNMAP), P2V(PHYSTOP));
+    kmem_init2(P2V(INIT_KERNMAP), P2V(meminfo.bank[meminfo.nbank - 1].end));
+    slab_init ();
+    zpool_init ();
+    pcache_init ();
     _puts("kmain: kmem_init complete\n");
 
     trap_init ();				// vector table and stacks for models
@@ -55,10 +69,17 @@ void kmain (void)
     gic_init(P2V(VIC_BASE));			// arm v2 gic init
     uart_enable_rx ();				// interrupt for uart
     consoleinit ();				// console
+
+#ifdef CONFIG_KMEM_BENCH
+    kmem_bench ();				// buddy allocator microbenchmark
+#endif
     pinit ();					// process (locks)
+    vma_init ();				// mapped regions
+    shm_init ();				// shared memory segments
 
     binit ();					// buffer cache
     fileinit ();				// file table
+    pipeinit ();				// pipe cache
     iinit ();					// inode cache
     ideinit ();					// ide (memory block device)
 
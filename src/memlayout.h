@@ -19,8 +19,31 @@
 #define VIRT_MMIO_IRQ_START 16 
 #define VIRT_MMIO_IRQ_END (VIRT_MMIO_IRQ_START + NUM_VIRTIO_TRANSPORTS - 1) /* inclusive */
 
+// the kernel reaches physical memory through the linear map at KERNBASE,
+// which covers the low 4GB (T1SZ is 32)
+#define MAX_PHYS_ADDR	0x100000000ULL
+
 #ifndef __ASSEMBLER__
 
+// physical memory found at boot, see fdt.c. Ranges are [start, end),
+// sorted by address.
+#define NMEMBANK	8
+#define NMEMRESV	8
+
+struct memrange {
+    uint64	start;
+    uint64	end;
+};
+
+struct meminfo {
+    int			nbank;
+    struct memrange	bank[NMEMBANK];		// RAM
+    int			nresv;
+    struct memrange	resv[NMEMRESV];		// reserved by the firmware
+};
+
+extern struct meminfo meminfo;
+
 static inline uint64 v2p(void *a) { return ((uint64) (a))  - (uint64)KERNBASE; }
 static inline void *p2v(uint64 a) { return (void *) ((a) + (uint64)KERNBASE); }
 
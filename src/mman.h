@@ -0,0 +1,13 @@
+// Memory mapping flags, for the mmap, munmap and mprotect system calls
+
+#define PROT_NONE       0x0
+#define PROT_READ       0x1
+#define PROT_WRITE      0x2
+#define PROT_EXEC       0x4
+
+#define MAP_SHARED      0x01    // changes go to the file
+#define MAP_PRIVATE     0x02    // changes are private (copy-on-write)
+#define MAP_FIXED       0x10    // map at addr, replacing what is there
+#define MAP_ANONYMOUS   0x20    // zero-filled memory, not a file
+
+#define MAP_FAILED      ((void*)-1)
@@ -11,7 +11,7 @@
 // lower than UVIR_BITS^2 is translated by TTBR0, while higher memory is
 // translated by TTBR1.
 // Kernel pages are create statically during system initialization. It use
-// 2MB page mapping. User pages use 4K pages.
+// block mappings. User pages use pages of the granule (below).
 //
 
 
@@ -42,6 +42,10 @@
 #define ENTRY_MASK	0x03
 #define ENTRY_FAULT	0x00
 
+// a block descriptor: maps 1GB (first level) or 2MB (second level), with
+// 4KB pages; see PT_BLOCK_LEVEL
+#define ENTRY_IS_BLOCK(e)	(((e) & ENTRY_MASK) == (ENTRY_BLOCK | ENTRY_VALID))
+
 #define MEM_ATTR_IDX_0	(0 << 2)
 #define MEM_ATTR_IDX_1	(1 << 2)
 #define MEM_ATTR_IDX_2	(2 << 2)
@@ -64,48 +68,116 @@
 #define SH_OUT_SH   (2 << 8)
 #define SH_IN_SH    (3 << 8)
 
-// Access flag not used by xv6, so always set to 1 to prevent
-// unnecessary page faults on first access.
+// Access flag: set on every new mapping, so the first access does not
+// fault. The page aging scanner clears it on user pages to see which
+// are referenced again (see ageuvm).
 #define ACCESS_FLAG (1 << 10)
 
+// user pages are not global: their TLB entries are tagged with the ASID
+#define NON_GLOBAL  (1 << 11)
+
+// dirty bit modifier: a read-only page with it set is writable but
+// clean, and the first write makes it read-write (dirty), done by the
+// MMU with TCR_EL1.HD or else by pagefault
+#define PTE_DBM     (1ULL << 51)
+
 #define PXN         (0x20000000000000)
 #define UXN         (0x40000000000000)
 
+// bits 58-55 are ignored by the MMU and free for software use
+#define PTE_COW     (1ULL << 55)    // shared copy-on-write page, see cowfault
+#define PTE_AGE_SHIFT   56          // scans since the page was referenced, see ageuvm
+#define PTE_AGE     (3ULL << PTE_AGE_SHIFT)
+
+
+// Translation granule, chosen at build time (make GRANULE=16K or 64K
+// defines CONFIG_GRANULE_16K or _64K; 4KB otherwise). The granule is
+// the page size, the size of a page table, and sets how many address
+// bits each level of the table resolves. Both halves of the address
+// space (TTBR0 for user, TTBR1 for kernel) use it.
+#if defined(CONFIG_GRANULE_64K)
+#define PG_SHIFT	16
+#define TCR_TG0		1					// TCR_EL1.TG0/TG1 encodings
+#define TCR_TG1		3
+#define TLBI_TG		3					// TG of the TLBI range operations
+#elif defined(CONFIG_GRANULE_16K)
+#define PG_SHIFT	14
+#define TCR_TG0		2
+#define TCR_TG1		1
+#define TLBI_TG		2
+#else
+#define PG_SHIFT	12
+#define TCR_TG0		0
+#define TCR_TG1		2
+#define TLBI_TG		1
+#endif
 
-#define PG_ADDR_MASK	0xFFFFFFFFF000	// bit 47 - bit 12
+#define PG_ADDR_MASK	(((1ULL << 48) - 1) & ~((1ULL << PG_SHIFT) - 1))	// bit 47 - granule
 
-// 1st level 
-#define PGD_SHIFT	30
-#define PGD_SZ		(1 << PGD_SHIFT)
-#define PGD_MASK 	(~(PGD_SZ - 1))			// offset for page directory entries
-#define PTRS_PER_PGD	4
-#define PGD_IDX(v)	(((uint64)(v) >> PGD_SHIFT) & (PTRS_PER_PGD - 1))	// index for page table entry
+// Size of the two halves of the address space: user (TTBR0, T0SZ is
+// 64 - UVA_BITS) and kernel (TTBR1, T1SZ is 64 - KVA_BITS). The user
+// size is chosen at build time (make UVA_BITS=n defines
+// CONFIG_UVA_BITS), 48 bits by default.
+#ifdef CONFIG_UVA_BITS
+#define UVA_BITS	CONFIG_UVA_BITS
+#else
+#define UVA_BITS	48
+#endif
+
+#if (UVA_BITS < 32) || (UVA_BITS > 48)
+#error "UVA_BITS must be 32 to 48"
+#endif
 
-// 2nd-level (2MB) page directory (always maps 1MB memory)
-#define PMD_SHIFT	21					// shift how many bits to get PDE index
+#define KVA_BITS	32
+
+// Page table levels, numbered as by the architecture: level 3 maps
+// pages, level 2 maps blocks or points to level 3 tables, and so on.
+// The address bits of each half take as many levels as they need, up
+// to the top one: for 48 bits four with 4KB pages (from level 0), and
+// for the 32 bits of the kernel three (from level 1), or two with 16KB
+// or 64KB pages. The top level table only has the entries it needs.
+// Bit 63 of an address tells the halves apart. See kernel/pagenav.c
+// for the walker.
+#define PT_BITS		(PG_SHIFT - 3)				// index bits per level
+#define PT_LEVELS(bits)	(((bits) - PG_SHIFT + PT_BITS - 1) / PT_BITS)
+#define PT_LEVEL_SHIFT(l)	(PG_SHIFT + (3 - (l)) * PT_BITS)	// address bits below level l
+#define PT_TOP_PTRS(bits)	(1 << ((bits) - PT_LEVEL_SHIFT(4 - PT_LEVELS(bits))))
+#define UPT_TOP_LEVEL	(4 - PT_LEVELS(UVA_BITS))
+#define KPT_TOP_LEVEL	(4 - PT_LEVELS(KVA_BITS))
+
+#define PT_VA_BITS(v)	(((uint64)(v) >> 63) ? KVA_BITS : UVA_BITS)
+#define PT_TOP_LEVEL(v)	(((uint64)(v) >> 63) ? KPT_TOP_LEVEL : UPT_TOP_LEVEL)
+#define PT_PTRS(v, l)	(((l) == PT_TOP_LEVEL(v)) ? PT_TOP_PTRS(PT_VA_BITS(v)) : (1 << PT_BITS))
+#define PT_IDX(v, l)	(((uint64)(v) >> PT_LEVEL_SHIFT(l)) & (PT_PTRS(v, l) - 1))
+#define PT_BLOCK_LEVEL	((PG_SHIFT == 12) ? 1 : 2)		// highest level with blocks
+
+// level 2 (2MB, 32MB or 512MB) block mappings
+#define PMD_SHIFT	PT_LEVEL_SHIFT(2)
 #define PMD_SZ      	(1 << PMD_SHIFT)
-#define PMD_MASK	(~(PMD_SZ - 1))				// offset for page directory entries
-#define PTRS_PER_PMD	512
-#define PMD_IDX(v)	(((uint64)(v) >> PMD_SHIFT) & (PTRS_PER_PMD - 1))	// index for page table entry
+#define PMD_MASK	(~(PMD_SZ - 1))
+#define PMD_IDX(v)	PT_IDX(v, 2)
 
-// 3rd-level (4k) page table
-#define PTE_SHIFT	12					// shift how many bits to get PTE index
+// level 3 (4KB, 16KB or 64KB) pages
+#define PTE_SHIFT	PG_SHIFT
 #define PTE_SZ		(1 << PTE_SHIFT)
-#define PTRS_PER_PTE	512
-#define PTE_ADDR(v)	align_dn (v, PTE_SZ)
-#define PTE_IDX(v)	(((uint64)(v) >> PTE_SHIFT) & (PTRS_PER_PTE - 1))
+#define PTRS_PER_PTE	(1 << PT_BITS)
+#define PTE_ADDR(v)	((uint64)(v) & PG_ADDR_MASK)
+#define PTE_IDX(v)	PT_IDX(v, 3)
 #define PTE_AP(pte)	(pte & AP_MASK)
 
-// size of two-level page tables
-#define UADDR_BITS	28					// maximum user-application memory, 256MB
-#define UADDR_SZ	(1 << UADDR_BITS)			// maximum user address space size
+// largest alloc_pages() order, the order of the buddy allocator's top
+// blocks: a level 2 block, but not more than 32MB. The 512MB blocks of
+// 64KB pages are not allocated, and huge pages are off there.
+#define MAX_ALLOC_SHIFT	((PMD_SHIFT < 25) ? PMD_SHIFT : 25)
+#define MAX_PAGE_ORDER	(MAX_ALLOC_SHIFT - PTE_SHIFT)
+#define PMD_ORDER	(PMD_SHIFT - PTE_SHIFT)			// pages in a block
 
-// must have NUM_UPDE == NUM_PTE
-//#define NUM_UPDE	(1 << (UADDR_BITS - PMD_SHIFT))		// # of PDE for user space
-//#define NUM_PTE	(1 << (PMD_SHIFT - PTE_SHIFT))		// how many PTE in a PT
+// user address space
+#define UADDR_SZ	(1ULL << UVA_BITS)			// maximum user address space size
+#define UMMAP_BASE	(UADDR_SZ >> 1)				// mmap regions, above the heap
 
-#define PT_SZ		(PTRS_PER_PTE << 3)			// user page table size (1K)
+#define PT_SZ		PTE_SZ					// page table size, a granule
 #define PT_ADDR(v)	align_dn(v, PT_SZ)			// physical address of the PT
-#define PT_ORDER	10
+#define PT_ORDER	PTE_SHIFT
 
 #endif
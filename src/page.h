@@ -0,0 +1,41 @@
+#ifndef INCLUDE_PAGE_H
+#define INCLUDE_PAGE_H
+
+// Physical page frame descriptors. The buddy allocator keeps one for
+// each page of the memory it manages (see kmem_init2), so the
+// descriptor of a page is found from its physical address in O(1).
+struct page {
+    uint        ref;        // # of users (mappings, kernel), 0 if free
+    uint        flags;
+    void*       owner;      // whoever owns/maps the page, e.g. a kmem_cache
+};
+
+#define PG_RESERVED 0x1  // not managed by the allocator (kernel, bitmaps)
+#define PG_SLAB     0x2  // a slab, owner is its kmem_cache
+#define PG_PGTBL    0x4  // a page table
+
+extern struct page  *mem_map;       // descriptor array
+extern uint64       mem_map_pa;     // physical address of mem_map[0]'s page
+extern uint64       mem_map_npages;
+
+// descriptor of the page containing physical address pa, or NULL if
+// the page is not managed by the allocator
+static inline struct page* pa2page (uint64 pa)
+{
+    uint64 idx;
+
+    idx = (pa - mem_map_pa) >> PTE_SHIFT;
+    return (pa < mem_map_pa || idx >= mem_map_npages) ? NULL : &mem_map[idx];
+}
+
+static inline uint64 page2pa (struct page *pg)
+{
+    return mem_map_pa + ((uint64)(pg - mem_map) << PTE_SHIFT);
+}
+
+static inline struct page* virt2page (void *v)
+{
+    return pa2page(v2p(v));
+}
+
+#endif
@@ -2,19 +2,23 @@
 #define PARAM_INCLUDE
 
 
-#define NPROC        64  // maximum number of processes
+#define NPROC       512  // maximum number of processes (allocated on demand)
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
 #define NBUF         10  // size of disk block cache
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // unreferenced i-nodes kept in the i-node cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
+#define MAXARGSZ   4096  // bytes of exec argument strings, with the nuls
+#define MAXPATH     128  // max path name, with the nul
+#define NSHM         16  // shared memory segments
+#define SHMMAX  (8*1024*1024)  // largest shared memory segment
 #define LOGSIZE      10  // max data sectors in on-disk log
 
 #define HZ           10
+#define AGE_TICKS    HZ  // ticks between page aging scans, see ageuvm
 
 #define N_CALLSTK    15
 #endif
\ No newline at end of file
@@ -0,0 +1,219 @@
+// Cache of shared program pages
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "fs.h"
+#include "file.h"
+#include "shrinker.h"
+
+// exec maps the segments of a program (and mmap maps files) and pagein
+// reads each page from the file on first touch. Pages that are wholly
+// backed by the file and not privately writable are the same for every
+// process mapping it, so pagein looks them up here first and maps them
+// shared; the struct page reference count keeps a page alive while any
+// process or the cache has it. The cache is direct mapped by (inode,
+// file offset) and holds one reference on each page. Writes to a file
+// and truncation drop its pages (pcache_forget), and the shrinker drops
+// pages no process maps. To keep pcache_forget cheap, the files that
+// have pages in the cache are listed in file[], and only those are
+// searched.
+
+#define NPCACHE     256     // cached pages
+#define NPCFILE     16      // files with cached pages
+
+struct pcpage {
+    uint    dev;
+    uint    inum;
+    uint    off;            // file offset of the page
+    char*   page;           // 0 if the slot is free
+};
+
+struct pcfile {
+    uint    dev;
+    uint    inum;
+    int     npage;          // 0 if the slot is free
+};
+
+static struct {
+    struct spinlock lock;
+    struct pcpage   page[NPCACHE];
+    struct pcfile   file[NPCFILE];
+
+    uint64          hits;
+    uint64          misses;
+} pcache;
+
+static struct pcpage* pc_slot (uint dev, uint inum, uint off)
+{
+    return &pcache.page[(dev * 31 + inum * 17 + off / PTE_SZ) % NPCACHE];
+}
+
+// find the file of ip, or a free slot for it if alloc is set
+static struct pcfile* pc_file (uint dev, uint inum, int alloc)
+{
+    struct pcfile *f, *empty;
+
+    empty = 0;
+
+    for (f = pcache.file; f < &pcache.file[NPCFILE]; f++) {
+        if ((f->npage > 0) && (f->dev == dev) && (f->inum == inum)) {
+            return f;
+        }
+
+        if ((f->npage == 0) && (empty == 0)) {
+            empty = f;
+        }
+    }
+
+    if (alloc && empty) {
+        empty->dev = dev;
+        empty->inum = inum;
+    }
+
+    return alloc ? empty : 0;
+}
+
+// empty a slot and return its page, whose reference the caller must
+// drop (with free_page, after releasing the lock)
+static char* pc_drop (struct pcpage *p)
+{
+    char *page;
+
+    pc_file(p->dev, p->inum, 0)->npage--;
+
+    page = p->page;
+    p->page = 0;
+
+    return page;
+}
+
+// Return the cached page of ip at off with a reference taken for the
+// caller, or 0.
+char* pcache_get (struct inode *ip, uint off)
+{
+    struct pcpage *p;
+    char *page;
+
+    page = 0;
+    acquire(&pcache.lock);
+
+    p = pc_slot(ip->dev, ip->inum, off);
+
+    if (p->page && (p->dev == ip->dev) && (p->inum == ip->inum) && (p->off == off)) {
+        get_page(p->page);
+        page = p->page;
+        pcache.hits++;
+
+    } else {
+        pcache.misses++;
+    }
+
+    release(&pcache.lock);
+    return page;
+}
+
+// Cache page, just read from ip at off, replacing the page in its slot.
+void pcache_add (struct inode *ip, uint off, char *page)
+{
+    struct pcpage *p;
+    struct pcfile *f;
+    char *old;
+
+    old = 0;
+    acquire(&pcache.lock);
+
+    p = pc_slot(ip->dev, ip->inum, off);
+
+    if (p->page) {
+        old = pc_drop(p);
+    }
+
+    if ((f = pc_file(ip->dev, ip->inum, 1)) != 0) {
+        get_page(page);
+        f->npage++;
+
+        p->dev = ip->dev;
+        p->inum = ip->inum;
+        p->off = off;
+        p->page = page;
+    }
+
+    release(&pcache.lock);
+
+    if (old) {
+        free_page(old);
+    }
+}
+
+// Drop the cached pages of ip, whose contents are about to change.
+void pcache_forget (struct inode *ip)
+{
+    struct pcpage *p;
+    struct pcfile *f;
+    char *old;
+
+    acquire(&pcache.lock);
+
+    f = pc_file(ip->dev, ip->inum, 0);
+
+    for (p = pcache.page; f && (f->npage > 0) && (p < &pcache.page[NPCACHE]); p++) {
+        if (p->page && (p->dev == ip->dev) && (p->inum == ip->inum)) {
+            old = pc_drop(p);
+
+            release(&pcache.lock);
+            free_page(old);
+            acquire(&pcache.lock);
+        }
+    }
+
+    release(&pcache.lock);
+}
+
+// under memory pressure, drop up to nr pages that no process maps
+static int pcache_shrink (int nr)
+{
+    struct pcpage *p;
+    char *old;
+    int n;
+
+    n = 0;
+    acquire(&pcache.lock);
+
+    for (p = pcache.page; (n < nr) && (p < &pcache.page[NPCACHE]); p++) {
+        if (p->page && (page_count(p->page) == 1)) {
+            old = pc_drop(p);
+            n++;
+
+            release(&pcache.lock);
+            free_page(old);
+            acquire(&pcache.lock);
+        }
+    }
+
+    release(&pcache.lock);
+    return n;
+}
+
+static struct shrinker pcache_shrinker = {
+    .name   = "pcache",
+    .shrink = pcache_shrink,
+};
+
+void pcache_init (void)
+{
+    initlock(&pcache.lock, "pcache");
+    register_shrinker(&pcache_shrinker);
+}
+
+void pcache_dump (void)
+{
+    int i, n;
+
+    for (i = n = 0; i < NPCACHE; i++) {
+        n += (pcache.page[i].page != 0);
+    }
+
+    cprintf("pcache: %d pages, %d hits, %d misses\n", n, (uint)pcache.hits, (uint)pcache.misses);
+}
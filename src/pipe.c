@@ -18,6 +18,21 @@ struct pipe {
     int writeopen;  // write fd is still open
 };
 
+static struct kmem_cache *pipe_cache;
+
+// pipes are returned to the cache with their lock initialized
+static void pipe_ctor(void *obj)
+{
+    initlock(&((struct pipe*)obj)->lock, "pipe");
+}
+
+void pipeinit(void)
+{
+    if((pipe_cache = kmem_cache_create("pipe", sizeof(struct pipe), pipe_ctor)) == 0) {
+        panic("pipeinit: pipe cache");
+    }
+}
+
 int pipealloc(struct file **f0, struct file **f1)
 {
     struct pipe *p;
@@ -29,7 +44,7 @@ int pipealloc(struct file **f0, struct file **f1)
         goto bad;
     }
 
-    if((p = kmalloc (get_order(sizeof(*p)))) == 0) {
+    if((p = kmem_cache_alloc(pipe_cache)) == 0) {
         goto bad;
     }
 
@@ -38,8 +53,6 @@ int pipealloc(struct file **f0, struct file **f1)
     p->nwrite = 0;
     p->nread = 0;
 
-    initlock(&p->lock, "pipe");
-
     (*f0)->type = FD_PIPE;
     (*f0)->readable = 1;
     (*f0)->writable = 0;
@@ -54,7 +67,7 @@ int pipealloc(struct file **f0, struct file **f1)
     //PAGEBREAK: 20
     bad:
     if(p) {
-        kfree (p, get_order(sizeof*p));
+        kmem_cache_free(pipe_cache, p);
     }
 
     if(*f0) {
@@ -83,7 +96,7 @@ void pipeclose(struct pipe *p, int writable)
 
     if(p->readopen == 0 && p->writeopen == 0){
         release(&p->lock);
-        kfree (p, get_order(sizeof(*p)));
+        kmem_cache_free(pipe_cache, p);
 
     } else {
         release(&p->lock);
@@ -24,11 +24,17 @@
 // between two processes, but instead, between the scheduler. Think of scheduler
 // as the idle process.
 //
+// Process descriptors are allocated on demand from a slab cache and
+// linked into ptable.head, so the table only costs memory for the
+// processes that exist. NPROC merely caps runaway forks.
 struct {
     struct spinlock lock;
-    struct proc proc[NPROC];
+    struct proc *head;
+    int nproc;
 } ptable;
 
+static struct kmem_cache *proc_cache;
+
 static struct proc *initproc;
 struct proc *proc;
 
@@ -41,11 +47,32 @@ static void wakeup1(void *chan);
 void pinit(void)
 {
     initlock(&ptable.lock, "ptable");
+
+    if ((proc_cache = kmem_cache_create("proc", sizeof(struct proc), 0)) == NULL) {
+        panic("pinit: proc cache");
+    }
+}
+
+// Unlink p from the process table and give it back to the cache.
+// The ptable lock must be held.
+static void freeproc(struct proc *p)
+{
+    struct proc **pp;
+
+    for(pp = &ptable.head; *pp != p; pp = &(*pp)->next) {
+        if(*pp == 0) {
+            panic("freeproc");
+        }
+    }
+
+    *pp = p->next;
+    ptable.nproc--;
+    kmem_cache_free(proc_cache, p);
 }
 
 //PAGEBREAK: 32
-// Look in the process table for an UNUSED proc.
-// If found, change state to EMBRYO and initialize
+// Allocate a new proc and add it to the process table.
+// If successful, change state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
 static struct proc* allocproc(void)
@@ -53,26 +80,33 @@ static struct proc* allocproc(void)
     struct proc *p;
     char *sp;
 
-    acquire(&ptable.lock);
+    if((p = kmem_cache_alloc(proc_cache)) == 0) {
+        return 0;
+    }
 
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-        if(p->state == UNUSED) {
-            goto found;
-        }
+    memset(p, 0, sizeof(*p));
 
-    }
+    acquire(&ptable.lock);
 
-    release(&ptable.lock);
-    return 0;
+    if(ptable.nproc >= NPROC) {
+        release(&ptable.lock);
+        kmem_cache_free(proc_cache, p);
+        return 0;
+    }
 
-    found:
     p->state = EMBRYO;
     p->pid = nextpid++;
+    p->next = ptable.head;
+    ptable.head = p;
+    ptable.nproc++;
+
     release(&ptable.lock);
 
     // Allocate kernel stack.
     if((p->kstack = alloc_page ()) == 0){
-        p->state = UNUSED;
+        acquire(&ptable.lock);
+        freeproc(p);
+        release(&ptable.lock);
         return 0;
     }
 
@@ -150,21 +184,27 @@ void userinit(void)
 
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
-int growproc(int n)
+int growproc(long n)
 {
-    uint sz;
+    uint64 sz;
 
     sz = proc->sz;
 
     if(n > 0){
-        if((sz = allocuvm(proc->pgdir, sz, sz + n)) == 0) {
+        // only reserve the range: each page is allocated and zeroed
+        // when first touched, see pagefault
+        if(sz + n >= UMMAP_BASE) {
             return -1;
         }
 
+        sz += n;
+
     } else if(n < 0){
-        if((sz = deallocuvm(proc->pgdir, sz, sz + n)) == 0) {
+        if((uint64)-n > sz) {
             return -1;
         }
+
+        sz = deallocuvm(proc->pgdir, sz, sz + n);
     }
 
     proc->sz = sz;
@@ -187,10 +227,12 @@ int fork(void)
     }
 
     // Copy process state from p.
-    if((np->pgdir = copyuvm(proc->pgdir, proc->sz)) == 0){
+    if(vma_dup(&np->vmas, proc->vmas) < 0 || (np->pgdir = copyuvm(proc)) == 0){
+        vma_free(&np->vmas, 0);
         free_page(np->kstack);
-        np->kstack = 0;
-        np->state = UNUSED;
+        acquire(&ptable.lock);
+        freeproc(np);
+        release(&ptable.lock);
         return -1;
     }
 
@@ -216,6 +258,51 @@ int fork(void)
     return pid;
 }
 
+// Create a child running the program at path, without copying the
+// address space of the parent as fork+exec would. If fds is 0, the
+// child inherits all open files; otherwise it gets only fds[0..2] as
+// its file descriptors 0..2 (a null entry leaves that one closed).
+// Return the pid of the child, or -1 if the program cannot be loaded.
+int spawn(char *path, char **argv, struct file **fds)
+{
+    int i, pid;
+    struct proc *np;
+
+    if((np = allocproc()) == 0) {
+        return -1;
+    }
+
+    np->parent = proc;
+    np->cwd = idup(proc->cwd);
+
+    // registers not set up by execproc start out as zero
+    memset(np->tf, 0, sizeof(*np->tf));
+    np->tf->spsr = proc->tf->spsr;
+
+    if(execproc(np, path, argv) < 0){
+        iput(np->cwd);
+        free_page(np->kstack);
+        acquire(&ptable.lock);
+        freeproc(np);
+        release(&ptable.lock);
+        return -1;
+    }
+
+    for(i = 0; i < NOFILE; i++) {
+        if(fds == 0 && proc->ofile[i]) {
+            np->ofile[i] = filedup(proc->ofile[i]);
+
+        } else if(fds != 0 && i < 3 && fds[i]) {
+            np->ofile[i] = filedup(fds[i]);
+        }
+    }
+
+    pid = np->pid;
+    np->state = RUNNABLE;
+
+    return pid;
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -239,13 +326,16 @@ void exit(void)
     iput(proc->cwd);
     proc->cwd = 0;
 
+    // write back shared file mappings while the pages are still there
+    vma_free(&proc->vmas, proc->pgdir);
+
     acquire(&ptable.lock);
 
     // Parent might be sleeping in wait().
     wakeup1(proc->parent);
 
     // Pass abandoned children to init.
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    for(p = ptable.head; p != 0; p = p->next){
         if(p->parent == proc){
             p->parent = initproc;
 
@@ -275,7 +365,7 @@ int wait(void)
         // Scan through table looking for zombie children.
         havekids = 0;
 
-        for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+        for(p = ptable.head; p != 0; p = p->next){
             if(p->parent != proc) {
                 continue;
             }
@@ -286,13 +376,8 @@ int wait(void)
                 // Found one.
                 pid = p->pid;
                 free_page(p->kstack);
-                p->kstack = 0;
                 freevm(p->pgdir);
-                p->state = UNUSED;
-                p->pid = 0;
-                p->parent = 0;
-                p->name[0] = 0;
-                p->killed = 0;
+                freeproc(p);
                 release(&ptable.lock);
 
                 return pid;
@@ -318,9 +403,31 @@ int wait(void)
 //  - swtch to start running that process
 //  - eventually that process transfers control
 //      via swtch back to the scheduler.
+// Age the pages of the processes every AGE_TICKS (see ageuvm). Called
+// by the scheduler with ptable.lock held: the processes that have a
+// page table are all stopped at a sleep or a yield.
+static void ageprocs(void)
+{
+    static uint last;
+    struct proc *p;
+
+    if(ticks - last < AGE_TICKS) {
+        return;
+    }
+
+    last = ticks;
+
+    for(p = ptable.head; p != 0; p = p->next){
+        if((p->state == SLEEPING || p->state == RUNNABLE) && p->pgdir) {
+            ageuvm(p);
+        }
+    }
+}
+
 void scheduler(void)
 {
     struct proc *p;
+    int ran;
 
     for(;;){
         // Enable interrupts on this processor.
@@ -328,8 +435,9 @@ void scheduler(void)
 
         // Loop over process table looking for process to run.
         acquire(&ptable.lock);
+        ran = 0;
 
-        for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+        for(p = ptable.head; p != 0; p = p->next){
             if(p->state != RUNNABLE) {
                 continue;
             }
@@ -341,6 +449,7 @@ void scheduler(void)
             switchuvm(p);
 
             p->state = RUNNING;
+            ran = 1;
 
             swtch(&cpu->scheduler, proc->context);
             // Process is done running for now.
@@ -348,7 +457,15 @@ void scheduler(void)
             proc = 0;
         }
 
+        ageprocs();
         release(&ptable.lock);
+
+        // Nothing to run: put the idle time to use by handing the
+        // deferred memory to the allocator, reclaiming memory if it
+        // is short, or else zeroing a free page for alloc_zeroed_page.
+        if(!ran && !kmem_populate() && !kmem_balance()) {
+            zpool_refill();
+        }
     }
 }
 
@@ -454,7 +571,7 @@ static void wakeup1(void *chan)
 {
     struct proc *p;
 
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
+    for(p = ptable.head; p != 0; p = p->next) {
         if(p->state == SLEEPING && p->chan == chan) {
             p->state = RUNNABLE;
         }
@@ -477,7 +594,7 @@ int kill(int pid)
 
     acquire(&ptable.lock);
 
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    for(p = ptable.head; p != 0; p = p->next){
         if(p->pid == pid){
             p->killed = 1;
 
@@ -512,7 +629,7 @@ void procdump(void)
     struct proc *p;
     char *state;
 
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    for(p = ptable.head; p != 0; p = p->next){
         if(p->state == UNUSED) {
             continue;
         }
@@ -523,7 +640,7 @@ void procdump(void)
             state = "???";
         }
 
-        cprintf("%d %s %s\n", p->pid, state, p->name);
+        cprintf("%d %s %s rss %d wss %d\n", p->pid, state, p->name, (uint)p->rss, (uint)p->wss);
     }
 
     show_callstk("procdump: \n");
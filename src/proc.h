@@ -69,10 +69,30 @@ struct context {
 
 enum procstate { UNUSED, EMBRYO, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A region of a process's address space: a program segment (see exec)
+// or an mmap. Nothing is mapped up front; pagefault fills in each page
+// when it is first touched, from the file for [fstart, fend) and with
+// zeroes otherwise; or from a shared memory segment (shm.c). The
+// regions of a process are sorted by address.
+struct vma {
+    uint64          start;          // page aligned
+    uint64          end;            // page aligned
+    int             prot;           // PROT_ bits, see mman.h
+    int             maxprot;        // prot may not grow beyond this
+    int             flags;          // MAP_SHARED or MAP_PRIVATE
+    struct inode*   ip;             // file, 0 for anonymous memory
+    struct shm*     shm;            // or shared memory segment, at off
+    uint64          fstart;         // the part read from the file
+    uint64          fend;
+    uint64          off;            // file offset of fstart
+    struct vma*     next;
+};
+
 // Per-process state
 struct proc {
     uint64          sz;             // Size of process memory (bytes)
     pgd_t*          pgdir;          // Page table
+    uint64          asid;           // ASID and its generation, see switchuvm
     char*           kstack;         // Bottom of kernel stack for this process
     enum procstate  state;          // Process state
     volatile int    pid;            // Process ID
@@ -83,7 +103,11 @@ struct proc {
     int             killed;         // If non-zero, have been killed
     struct file*    ofile[NOFILE];  // Open files
     struct inode*   cwd;            // Current directory
+    struct vma*     vmas;           // Mapped regions, see vma.c
+    uint64          rss;            // Pages mapped, as of the last ageuvm
+    uint64          wss;            // Pages in the working set, see ageuvm
     char            name[16];       // Process name (debugging)
+    struct proc*    next;           // Next in the process table
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -91,4 +115,6 @@ struct proc {
 //   original data and bss
 //   fixed-size stack
 //   expandable heap
+//   ...
+//   mmap regions, from UMMAP_BASE up
 #endif
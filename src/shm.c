@@ -0,0 +1,188 @@
+// Shared memory segments
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+// A segment is a set of pages that several processes map at once, to
+// pass data without copying it. shmget finds the segment of a key (or
+// makes one) and returns it as a file descriptor; mmap with MAP_SHARED
+// attaches it, munmap and close detach it. The segment counts its open
+// files and mappings (fork duplicates both), and goes away, pages and
+// all, with the last of them. Pages are allocated, zeroed, when first
+// touched through any mapping; the segment keeps a reference on each,
+// so every process that touches the page later maps the same one.
+
+#define SHM_PRIVATE 0       // key of a segment shmget always makes anew
+
+struct shm {
+    int     key;            // SHM_PRIVATE for an unnamed segment
+    int     ref;            // files and mappings, 0 if the slot is free
+    uint64  size;           // page aligned
+    char**  pages;          // size / PTE_SZ of them, 0 if not touched
+    int     order;          // of the pages array, see kmalloc
+};
+
+static struct {
+    struct spinlock lock;
+    struct shm      shm[NSHM];
+} shmtab;
+
+void shm_init (void)
+{
+    initlock(&shmtab.lock, "shm");
+}
+
+// Return the segment of key with a reference held for the caller,
+// making one of size bytes if there is none (or key is SHM_PRIVATE).
+// An existing segment must be at least size bytes. Returns 0 if size
+// is too large, or no segment or memory is left.
+struct shm* shm_get (int key, uint64 size)
+{
+    struct shm *s, *empty;
+    char **pages;
+    int order;
+
+    if ((size == 0) || (size > SHMMAX)) {
+        return 0;
+    }
+
+    size = align_up(size, PTE_SZ);
+    order = get_order((size / PTE_SZ) * sizeof(char*));
+
+    // allocate and clear the pages array before taking the lock: it is
+    // given back if the segment turns out to exist
+    if ((pages = kmalloc(order)) == 0) {
+        return 0;
+    }
+
+    memset(pages, 0, 1 << order);
+
+    acquire(&shmtab.lock);
+    empty = 0;
+
+    for (s = shmtab.shm; s < &shmtab.shm[NSHM]; s++) {
+        if ((s->ref > 0) && (key != SHM_PRIVATE) && (s->key == key)) {
+            break;
+        }
+
+        if ((s->ref == 0) && (empty == 0)) {
+            empty = s;
+        }
+    }
+
+    if (s < &shmtab.shm[NSHM]) {
+        if (s->size < size) {
+            s = 0;
+        } else {
+            s->ref++;
+        }
+
+    } else if ((s = empty) != 0) {
+        s->key = key;
+        s->ref = 1;
+        s->size = size;
+        s->pages = pages;
+        s->order = order;
+        pages = 0;
+    }
+
+    release(&shmtab.lock);
+
+    if (pages) {
+        kfree(pages, order);
+    }
+
+    return s;
+}
+
+// take another reference to s, for a new file or mapping
+void shm_dup (struct shm *s)
+{
+    acquire(&shmtab.lock);
+
+    if (s->ref < 1) {
+        panic("shm_dup");
+    }
+
+    s->ref++;
+    release(&shmtab.lock);
+}
+
+// Drop a reference to s, and free it with the last one. The pages
+// stay until the processes that map them unmap them, too.
+void shm_put (struct shm *s)
+{
+    struct shm old;
+    uint64 i;
+
+    acquire(&shmtab.lock);
+
+    if (s->ref < 1) {
+        panic("shm_put");
+    }
+
+    if (--s->ref > 0) {
+        release(&shmtab.lock);
+        return;
+    }
+
+    old = *s;
+    s->pages = 0;
+    release(&shmtab.lock);
+
+    for (i = 0; i < old.size / PTE_SZ; i++) {
+        if (old.pages[i]) {
+            free_page(old.pages[i]);
+        }
+    }
+
+    kfree(old.pages, old.order);
+}
+
+uint64 shm_size (struct shm *s)
+{
+    return s->size;
+}
+
+// Return the page of s at off (page aligned), with a reference taken
+// for the caller, who maps it. Returns 0 if off is past the end of s or
+// memory is short.
+char* shm_page (struct shm *s, uint64 off)
+{
+    char *page, *mem;
+
+    if (off >= s->size) {
+        return 0;
+    }
+
+    // allocated without the lock, which another process may race for
+    mem = 0;
+    acquire(&shmtab.lock);
+
+    while ((page = s->pages[off / PTE_SZ]) == 0) {
+        if (mem) {
+            s->pages[off / PTE_SZ] = mem;
+            mem = 0;
+            continue;
+        }
+
+        release(&shmtab.lock);
+
+        if ((mem = alloc_zeroed_page()) == 0) {
+            return 0;
+        }
+
+        acquire(&shmtab.lock);
+    }
+
+    get_page(page);
+    release(&shmtab.lock);
+
+    if (mem) {
+        free_page(mem);
+    }
+
+    return page;
+}
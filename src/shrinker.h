@@ -0,0 +1,15 @@
+#ifndef INCLUDE_SHRINKER_H
+#define INCLUDE_SHRINKER_H
+
+// A cache that can give memory back to the buddy allocator under
+// pressure, see kmem_reclaim in buddy.c. shrink is called without any
+// spinlock held and should release about nr pages; it returns the
+// number of pages (or objects, for object caches) it let go.
+struct shrinker {
+    char*               name;
+    int                 (*shrink)(int nr);
+    uint64              released;       // total returned by shrink
+    struct shrinker*    next;
+};
+
+#endif
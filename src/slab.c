@@ -0,0 +1,368 @@
+// Slab allocator for kernel objects
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "arm.h"
+#include "proc.h"
+#include "page.h"
+#include "shrinker.h"
+
+// Object caches in the style of Bonwick's slab allocator, built on top of
+// the buddy allocator. A cache hands out fixed-size objects carved from
+// page-sized slabs. The slab header lives at the start of its page, so
+// the slab of an object is found by rounding the object address down.
+// Each slab is on one of three lists of its cache (full, partial, empty).
+// In front of the slabs, each CPU keeps a small stack of free objects so
+// that most allocations and frees don't touch the cache lock at all.
+//
+// An optional constructor is run once for each object when its slab is
+// created; objects must be returned to the cache in constructed state.
+// A free object is linked into its slab through its first word, or, in
+// a cache with a constructor, through a word past the object, so that
+// the link does not overwrite the constructed state.
+
+#define SLAB_ORDER      PTE_SHIFT
+#define SLAB_SZ         (1 << SLAB_ORDER)
+#define SLAB_ALIGN      8
+#define CPU_CACHE_SZ    16
+#define CPU_CACHE_BATCH (CPU_CACHE_SZ / 2)
+
+struct slab {
+    struct slab*        next;           // links in one of the slab lists
+    struct slab*        prev;
+    struct kmem_cache*  cache;          // owner of this slab
+    void*               freelist;       // free objects in this slab
+    uint                inuse;          // # of objects handed out
+};
+
+struct cpu_cache {
+    int                 cnt;
+    void*               objs[CPU_CACHE_SZ];
+};
+
+struct kmem_cache {
+    struct spinlock     lock;
+    char*               name;
+    uint                size;           // object size (aligned), with the link
+    uint                link;           // offset of the freelist link in an object
+    uint                num;            // objects per slab
+    uint                offset;         // offset of the first object
+    void                (*ctor)(void*);
+
+    struct slab*        full;           // slabs with no free object
+    struct slab*        partial;        // slabs with some free objects
+    struct slab*        empty;          // slabs with no object in use
+
+    uint                nslabs;         // slabs owned by the cache
+    uint                nactive;        // objects handed out
+
+    struct cpu_cache    cpu[NCPU];
+    struct kmem_cache*  next;           // all caches, see kmem_cache_dump
+};
+
+static struct {
+    struct spinlock     lock;
+    struct kmem_cache*  head;
+} caches;
+
+static inline struct slab* obj2slab (void *obj)
+{
+    return (struct slab*) align_dn(obj, SLAB_SZ);
+}
+
+// the freelist link of a free object
+static inline void** obj_link (struct kmem_cache *c, void *obj)
+{
+    return (void**) ((char*)obj + c->link);
+}
+
+static void slab_unlink (struct slab **list, struct slab *s)
+{
+    if (s->prev != NULL) {
+        s->prev->next = s->next;
+    } else {
+        *list = s->next;
+    }
+
+    if (s->next != NULL) {
+        s->next->prev = s->prev;
+    }
+
+    s->next = s->prev = NULL;
+}
+
+static void slab_push (struct slab **list, struct slab *s)
+{
+    s->prev = NULL;
+    s->next = *list;
+
+    if (*list != NULL) {
+        (*list)->prev = s;
+    }
+
+    *list = s;
+}
+
+static int slab_shrink (int nr);
+
+static struct shrinker slab_shrinker = {
+    .name   = "slab",
+    .shrink = slab_shrink,
+};
+
+void slab_init (void)
+{
+    initlock(&caches.lock, "slab");
+    caches.head = NULL;
+
+    register_shrinker(&slab_shrinker);
+}
+
+// create a new object cache
+struct kmem_cache* kmem_cache_create (char *name, uint size, void (*ctor)(void*))
+{
+    struct kmem_cache *c;
+
+    if ((c = kmalloc(get_order(sizeof(*c)))) == NULL) {
+        return NULL;
+    }
+
+    memset(c, 0, sizeof(*c));
+    initlock(&c->lock, name);
+
+    c->name   = name;
+    c->size   = align_up(size, SLAB_ALIGN);
+    c->link   = 0;
+
+    if (ctor) {
+        c->link = c->size;
+        c->size += sizeof(void*);
+    }
+
+    c->offset = align_up(sizeof(struct slab), SLAB_ALIGN);
+    c->num    = (SLAB_SZ - c->offset) / c->size;
+    c->ctor   = ctor;
+
+    if (c->num == 0) {
+        panic("kmem_cache_create: object too big");
+    }
+
+    acquire(&caches.lock);
+    c->next = caches.head;
+    caches.head = c;
+    release(&caches.lock);
+
+    return c;
+}
+
+// get a new slab from the buddy allocator and construct its objects.
+// Called with the cache lock held.
+static struct slab* slab_grow (struct kmem_cache *c)
+{
+    struct slab *s;
+    char *obj;
+    int i;
+
+    if ((s = alloc_page()) == NULL) {
+        return NULL;
+    }
+
+    virt2page(s)->flags |= PG_SLAB;
+    virt2page(s)->owner  = c;
+
+    s->cache    = c;
+    s->inuse    = 0;
+    s->freelist = NULL;
+
+    // chain the objects in address order
+    for (i = c->num - 1; i >= 0; i--) {
+        obj = (char*)s + c->offset + i * c->size;
+
+        if (c->ctor) {
+            c->ctor(obj);
+        }
+
+        *obj_link(c, obj) = s->freelist;
+        s->freelist = obj;
+    }
+
+    slab_push(&c->empty, s);
+    c->nslabs++;
+
+    return s;
+}
+
+// take one object out of the slabs. Called with the cache lock held.
+static void* slab_get_obj (struct kmem_cache *c)
+{
+    struct slab *s;
+    void *obj;
+
+    if ((s = c->partial) != NULL) {
+        slab_unlink(&c->partial, s);
+
+    } else if ((s = c->empty) != NULL || (s = slab_grow(c)) != NULL) {
+        slab_unlink(&c->empty, s);
+
+    } else {
+        return NULL;
+    }
+
+    obj = s->freelist;
+    s->freelist = *obj_link(c, obj);
+    s->inuse++;
+    c->nactive++;
+
+    slab_push((s->inuse == c->num) ? &c->full : &c->partial, s);
+
+    return obj;
+}
+
+// return one object to its slab. Called with the cache lock held.
+static void slab_put_obj (struct kmem_cache *c, void *obj)
+{
+    struct slab *s;
+
+    s = obj2slab(obj);
+
+    if (s->cache != c) {
+        panic("kmem_cache_free: wrong cache");
+    }
+
+    slab_unlink((s->inuse == c->num) ? &c->full : &c->partial, s);
+
+    *obj_link(c, obj) = s->freelist;
+    s->freelist = obj;
+    s->inuse--;
+    c->nactive--;
+
+    if (s->inuse > 0) {
+        slab_push(&c->partial, s);
+        return;
+    }
+
+    // keep one empty slab around to absorb alloc/free ping-pong
+    if (c->empty == NULL) {
+        slab_push(&c->empty, s);
+        return;
+    }
+
+    c->nslabs--;
+    free_page(s);
+}
+
+// allocate an object from the cache
+void* kmem_cache_alloc (struct kmem_cache *c)
+{
+    struct cpu_cache *cc;
+    void *obj;
+
+    pushcli();
+
+    cc = &c->cpu[cpu - cpus];
+
+    if (cc->cnt == 0) {
+        acquire(&c->lock);
+
+        while (cc->cnt < CPU_CACHE_BATCH) {
+            if ((obj = slab_get_obj(c)) == NULL) {
+                break;
+            }
+
+            cc->objs[cc->cnt++] = obj;
+        }
+
+        release(&c->lock);
+    }
+
+    obj = (cc->cnt > 0) ? cc->objs[--cc->cnt] : NULL;
+
+    popcli();
+
+    return obj;
+}
+
+// return an object to the cache
+void kmem_cache_free (struct kmem_cache *c, void *obj)
+{
+    struct cpu_cache *cc;
+    int i;
+
+    pushcli();
+
+    cc = &c->cpu[cpu - cpus];
+
+    if (cc->cnt == CPU_CACHE_SZ) {
+        acquire(&c->lock);
+
+        for (i = 0; i < CPU_CACHE_BATCH; i++) {
+            slab_put_obj(c, cc->objs[i]);
+        }
+
+        release(&c->lock);
+
+        memmove(cc->objs, cc->objs + CPU_CACHE_BATCH,
+                (cc->cnt - CPU_CACHE_BATCH) * sizeof(cc->objs[0]));
+        cc->cnt -= CPU_CACHE_BATCH;
+    }
+
+    cc->objs[cc->cnt++] = obj;
+
+    popcli();
+}
+
+// under memory pressure: return the objects cached by this CPU to their
+// slabs and free all the empty slabs. The other CPUs keep theirs.
+static int slab_shrink (int nr)
+{
+    struct kmem_cache *c;
+    struct cpu_cache *cc;
+    struct slab *s;
+    int freed;
+
+    freed = 0;
+
+    acquire(&caches.lock);
+
+    for (c = caches.head; c != NULL; c = c->next) {
+        acquire(&c->lock);
+
+        cc = &c->cpu[cpu - cpus];
+
+        while (cc->cnt > 0) {
+            slab_put_obj(c, cc->objs[--cc->cnt]);
+        }
+
+        while ((s = c->empty) != NULL) {
+            slab_unlink(&c->empty, s);
+            c->nslabs--;
+            free_page(s);
+            freed++;
+        }
+
+        release(&c->lock);
+    }
+
+    release(&caches.lock);
+
+    return freed;
+}
+
+// print the usage of all object caches
+void kmem_cache_dump (void)
+{
+    struct kmem_cache *c;
+
+    cprintf("cache       size  per-slab  slabs  active\n");
+
+    acquire(&caches.lock);
+
+    for (c = caches.head; c != NULL; c = c->next) {
+        cprintf("%s  %d  %d  %d  %d\n", c->name, c->size, c->num, c->nslabs, c->nactive);
+    }
+
+    release(&caches.lock);
+}
@@ -56,18 +56,42 @@ uint64 *user_pgtbl = &_user_pgtbl;
 
 extern void * vectors;
 
-// setup the boot page table: dev_mem whether it is device memory
+// Set PGD Entries of pgtbl to the level 2 tables at l2pgtbl (4
+// entries...supporting 32 bits). With 16KB or 64KB pages, the top
+// level table is a level 2 one already.
+static void set_bootl1 (uint64 *pgtbl, uint64 l2pgtbl)
+{
+#if KPT_TOP_LEVEL < 2
+    uint	index;
+
+    for(index = 0; index < PT_TOP_PTRS(KVA_BITS); index++) {
+        pgtbl[index] = (l2pgtbl + index * PT_SZ) | ENTRY_TABLE | ENTRY_VALID;
+    }
+#endif
+}
+
+// the level 2 table of pgtbl that maps virt: the top level one with
+// 16KB or 64KB pages, one of the boot tables below it with 4KB
+static uint64* boot_level2 (uint64 *pgtbl, uint64 virt)
+{
+#if KPT_TOP_LEVEL < 2
+    return (uint64 *)(pgtbl[PT_IDX(virt, KPT_TOP_LEVEL)] & PG_ADDR_MASK);
+#else
+    return pgtbl;
+#endif
+}
+
+// setup the boot page table with level 2 blocks (2MB with 4KB pages):
+// dev_mem whether it is device memory
 void set_bootpgtbl (uint64 virt, uint64 phy, uint len, int dev_mem )
 {
     uint64	pde;
     int         idx;
-    int		pgdidx;
     int		pmdidx;
     uint64	*level2;
 
-    for (idx = 0; idx < len; idx = idx + 0x200000) {
+    for (idx = 0; idx < len; idx = idx + PMD_SZ) {
 
-        pgdidx = PGD_IDX(virt);
         pmdidx = PMD_IDX(virt);
 
         pde = phy & PMD_MASK;
@@ -80,14 +104,14 @@ void set_bootpgtbl (uint64 virt, uint64 phy, uint len, int dev_mem )
             pde |= ACCESS_FLAG | AP_RW_1 | MEM_ATTR_IDX_0 | ENTRY_BLOCK | ENTRY_VALID;
         }
 
-        level2 = (uint64 *)(kernel_pgtbl[pgdidx] & PG_ADDR_MASK);
+        level2 = boot_level2(kernel_pgtbl, virt);
         level2[pmdidx] = pde;
 
-        level2 = (uint64 *)(user_pgtbl[pgdidx] & PG_ADDR_MASK);
+        level2 = boot_level2(user_pgtbl, virt);
         level2[pmdidx] = pde;
 
-        virt = virt + 0x200000;
-        phy = phy + 0x200000;
+        virt = virt + PMD_SZ;
+        phy = phy + PMD_SZ;
 
     }
 }
@@ -131,6 +155,24 @@ void load_pgtlb (uint64* kern_pgtbl, uint64* user_pgtbl)
             _puts("Current EL: Unknown\n");
     }
 
+    // the translation granule must be implemented: ID_AA64MMFR0_EL1
+    // TGran4 [31:28] and TGran64 [27:24] are 0xF without, TGran16
+    // [23:20] is 0 without
+    asm("MRS %[r], ID_AA64MMFR0_EL1":[r]"=r" (val64): :);
+
+#if PG_SHIFT == 16
+    val64 = ((val64 >> 24) & 0x0F) != 0x0F;
+#elif PG_SHIFT == 14
+    val64 = ((val64 >> 20) & 0x0F) != 0;
+#else
+    val64 = ((val64 >> 28) & 0x0F) != 0x0F;
+#endif
+
+    if (!val64) {
+        _puts ("Translation granule not supported by the CPU\n");
+        while (1);
+    }
+
     // flush TLB and cache
     _puts("Flushing TLB and Instr Cache\n");
 
@@ -158,18 +200,21 @@ void load_pgtlb (uint64* kern_pgtbl, uint64* user_pgtbl)
     //val64 = val64 + (uint64)KERNBASE;
     asm("MSR VBAR_EL1, %[v]": :[v]"r" (val64):);
 
-    // set translation control register
+    // set translation control register. The boot map in TTBR0 has the
+    // layout of the kernel one, so both start with its size; the first
+    // process sets the user size, see switchuvm.
     _puts("Setting Translation Control Register (TCR_EL1)\n");
     val64 = (uint64)(
-        (32UL << TCR_EL1_T0SZ)
+        ((64UL - KVA_BITS) << TCR_EL1_T0SZ)
         | (1UL << TCR_EL1_IRGN0)
         | (1UL << TCR_EL1_ORGN0)
         | (3UL << TCR_EL1_SH0)
-        | (32UL << TCR_EL1_T1SZ)
+        | ((uint64)TCR_TG0 << TCR_EL1_TG0)
+        | ((64UL - KVA_BITS) << TCR_EL1_T1SZ)
         | (1UL << TCR_EL1_IRGN1)
         | (1UL << TCR_EL1_ORGN1)
         | (3UL << TCR_EL1_SH1)
-        | (2UL << TCR_EL1_TG1)
+        | ((uint64)TCR_TG1 << TCR_EL1_TG1)
         | (4UL << TCR_EL1_IPS)
         | (1UL << TCR_EL1_AS)
         | (1UL << TCR_EL1_TBI0)
@@ -206,7 +251,7 @@ extern void * edata;
 extern void * end;
 
 extern void jump_stack (void);
-extern void kmain (void);
+extern void kmain (uint64 dtb);
 
 // clear the BSS section for the main kernel, see kernel.ld
 void clear_bss (void)
@@ -215,27 +260,13 @@ void clear_bss (void)
     memset(&edata, 0x00, &end-&edata);
 }
 
-void start (void)
+// dtb: physical address of the device tree blob from the boot loader
+void start (uint64 dtb)
 {
-    uint64	l2pgtbl;
-    uint	index;
-
     _puts("starting xv6 for ARMv8...\n");
 
-    // Set PGD Entries (4 entries...supporting 32 bits)
-    for(index = 0; index < 4; index++) {
-        l2pgtbl = (uint64)&_K_l2_pgtbl;
-        l2pgtbl += index * 4096;
-        l2pgtbl = l2pgtbl | ENTRY_TABLE | ENTRY_VALID;
-        kernel_pgtbl[index] = l2pgtbl;
-    }
-
-    for(index = 0; index < 4; index++) {
-        l2pgtbl = (uint64)&_U_l2_pgtbl;
-        l2pgtbl += index * 4096;
-        l2pgtbl = l2pgtbl | ENTRY_TABLE | ENTRY_VALID;
-        user_pgtbl[index] = l2pgtbl;
-    }
+    set_bootl1(kernel_pgtbl, (uint64)&_K_l2_pgtbl);
+    set_bootl1(user_pgtbl, (uint64)&_U_l2_pgtbl);
 
     // double map the low memory, required to enable paging
     // we do not map all the physical memory
@@ -259,5 +290,5 @@ void start (void)
     clear_bss ();
 
     _puts("Starting Kernel\n");
-    kmain ();
+    kmain (dtb);
 }
@@ -10,47 +10,22 @@
 // User code makes a system call with INT T_SYSCALL. System call number
 // in r0. Arguments on the stack, from the user call to the C library
 // system call function. The saved user sp points to the first argument.
+// User memory is read and written with the primitives of uaccess.S,
+// which the MMU checks: they fail on an address the process may not
+// access that way.
 
 // Fetch the int at addr from the current process.
 int fetchint(uint64 addr, long *ip)
 {
-    if(addr >= proc->sz || addr+8 > proc->sz) {
-        return -1;
-    }
-
-    *ip = *(long*)(addr);
-    return 0;
-}
-
-// Fetch the nul-terminated string at addr from the current process.
-// Doesn't actually copy the string - just sets *pp to point at it.
-// Returns length of string, not including nul.
-int fetchstr(uint64 addr, char **pp)
-{
-    char *s, *ep;
-
-    if(addr >= proc->sz) {
-        return -1;
-    }
-
-    *pp = (char*)addr;
-    ep = (char*)proc->sz;
-
-    for(s = *pp; s < ep; s++) {
-        if(*s == 0) {
-            return s - *pp;
-        }
-    }
-
-    return -1;
+    return copy_from_user(ip, addr, sizeof(*ip));
 }
 
 // Fetch the nth (starting from 0) 32-bit system call argument.
-// In our ABI, r0 contains system call index, r1-r4 contain parameters.
-// now we support system calls with at most 4 parameters.
+// In our ABI, r0 contains system call index, r1-r6 contain parameters.
+// now we support system calls with at most 6 parameters (mmap).
 int argint(int n, long *ip)
 {
-    if (n > 3) {
+    if (n > 5) {
         panic ("too many system call parameters\n");
     }
 
@@ -59,30 +34,52 @@ int argint(int n, long *ip)
     return 0;
 }
 
-// Fetch the nth word-sized system call argument as a pointer
-// to a block of memory of size n bytes.  Check that the pointer
-// lies within the process address space.
-int argptr(int n, char **pp, int size)
+// Fetch the nth word-sized system call argument as a pointer to a
+// block of memory of size n bytes, which the kernel writes to if write
+// is set. Check that the pointer lies within the process address space
+// and get its pages in now: the system call accesses the memory in
+// place, maybe with locks held, when the pages cannot be read from the
+// program file. Reading a byte of each page faults it in, and fails if
+// the process may not access it; pages to write are made writable by
+// writeuvm, which checks that the process may write them.
+static int argbuf(int n, char **pp, int size, int write)
 {
     long i;
+    uint64 a;
 
     if(argint(n, &i) < 0) {
         return -1;
     }
 
-    if((uint64)i >= proc->sz || (uint64)i+size > proc->sz) {
+    if((uint64)i >= UADDR_SZ || (uint64)i+size > UADDR_SZ) {
         return -1;
     }
 
+    for(a = i; a < (uint64)i + size; a = align_dn(a, PTE_SZ) + PTE_SZ) {
+        if((write ? writeuvm(proc, a) : touch_user(a)) < 0) {
+            return -1;
+        }
+    }
+
     *pp = (char*)i;
     return 0;
 }
 
-// Fetch the nth word-sized system call argument as a string pointer.
-// Check that the pointer is valid and the string is nul-terminated.
-// (There is no shared writable memory, so the string can't change
-// between this check and being used by the kernel.)
-int argstr(int n, char **pp)
+int argptr(int n, char **pp, int size)
+{
+    return argbuf(n, pp, size, 0);
+}
+
+// Like argptr, for memory the system call fills in.
+int argoutptr(int n, char **pp, int size)
+{
+    return argbuf(n, pp, size, 1);
+}
+
+// Fetch the nth word-sized system call argument as a string pointer,
+// and copy the string to buf, of max bytes. Returns the length of the
+// string, or -1 if it is not nul-terminated within max bytes.
+int argstr(int n, char *buf, int max)
 {
     long addr;
 
@@ -90,32 +87,38 @@ int argstr(int n, char **pp)
         return -1;
     }
 
-    return fetchstr(addr, pp);
+    return strncpy_from_user(buf, addr, max);
 }
 
-extern int sys_chdir(void);
-extern int sys_close(void);
-extern int sys_dup(void);
-extern int sys_exec(void);
-extern int sys_exit(void);
-extern int sys_fork(void);
-extern int sys_fstat(void);
-extern int sys_getpid(void);
-extern int sys_kill(void);
-extern int sys_link(void);
-extern int sys_mkdir(void);
-extern int sys_mknod(void);
-extern int sys_open(void);
-extern int sys_pipe(void);
-extern int sys_read(void);
-extern int sys_sbrk(void);
-extern int sys_sleep(void);
-extern int sys_unlink(void);
-extern int sys_wait(void);
-extern int sys_write(void);
-extern int sys_uptime(void);
-
-static int (*syscalls[])(void) = {
+extern long sys_chdir(void);
+extern long sys_close(void);
+extern long sys_dup(void);
+extern long sys_exec(void);
+extern long sys_exit(void);
+extern long sys_fork(void);
+extern long sys_fstat(void);
+extern long sys_getpid(void);
+extern long sys_kill(void);
+extern long sys_link(void);
+extern long sys_mkdir(void);
+extern long sys_mknod(void);
+extern long sys_open(void);
+extern long sys_pipe(void);
+extern long sys_read(void);
+extern long sys_sbrk(void);
+extern long sys_sleep(void);
+extern long sys_unlink(void);
+extern long sys_wait(void);
+extern long sys_write(void);
+extern long sys_uptime(void);
+extern long sys_kmemstat(void);
+extern long sys_spawn(void);
+extern long sys_mmap(void);
+extern long sys_munmap(void);
+extern long sys_mprotect(void);
+extern long sys_shmget(void);
+
+static long (*syscalls[])(void) = {
         [SYS_fork]    = sys_fork,
         [SYS_exit]    = sys_exit,
         [SYS_wait]    = sys_wait,
@@ -137,12 +140,18 @@ static int (*syscalls[])(void) = {
         [SYS_link]    = sys_link,
         [SYS_mkdir]   = sys_mkdir,
         [SYS_close]   = sys_close,
+        [SYS_kmemstat] = sys_kmemstat,
+        [SYS_spawn]    = sys_spawn,
+        [SYS_mmap]     = sys_mmap,
+        [SYS_munmap]   = sys_munmap,
+        [SYS_mprotect] = sys_mprotect,
+        [SYS_shmget]   = sys_shmget,
 };
 
 void syscall(void)
 {
     int num;
-    int ret;
+    long ret;
 
     num = proc->tf->r0;
 
@@ -20,3 +20,9 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_kmemstat 22
+#define SYS_spawn  23
+#define SYS_mmap   24
+#define SYS_munmap 25
+#define SYS_mprotect 26
+#define SYS_shmget 27
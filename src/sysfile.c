@@ -13,6 +13,7 @@
 #include "fs.h"
 #include "file.h"
 #include "fcntl.h"
+#include "mman.h"
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
@@ -56,7 +57,7 @@ static int fdalloc(struct file *f)
     return -1;
 }
 
-int sys_dup(void)
+long sys_dup(void)
 {
     struct file *f;
     int fd;
@@ -74,20 +75,20 @@ int sys_dup(void)
     return fd;
 }
 
-int sys_read(void)
+long sys_read(void)
 {
     struct file *f;
     long n;
     char *p;
 
-    if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0) {
+    if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argoutptr(1, &p, n) < 0) {
         return -1;
     }
 
     return fileread(f, p, n);
 }
 
-int sys_write(void)
+long sys_write(void)
 {
     struct file *f;
     long n;
@@ -100,7 +101,7 @@ int sys_write(void)
     return filewrite(f, p, n);
 }
 
-int sys_close(void)
+long sys_close(void)
 {
     int fd;
     struct file *f;
@@ -115,25 +116,26 @@ int sys_close(void)
     return 0;
 }
 
-int sys_fstat(void)
+long sys_fstat(void)
 {
     struct file *f;
-    struct stat *st;
+    struct stat st;
+    long ust;
 
-    if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0) {
+    if(argfd(0, 0, &f) < 0 || argint(1, &ust) < 0 || filestat(f, &st) < 0) {
         return -1;
     }
 
-    return filestat(f, st);
+    return copy_to_user(ust, &st, sizeof(st));
 }
 
 // Create the path new as a link to the same inode as old.
-int sys_link(void)
+long sys_link(void)
 {
-    char name[DIRSIZ], *new, *old;
+    char name[DIRSIZ], new[MAXPATH], old[MAXPATH];
     struct inode *dp, *ip;
 
-    if(argstr(0, &old) < 0 || argstr(1, &new) < 0) {
+    if(argstr(0, old, MAXPATH) < 0 || argstr(1, new, MAXPATH) < 0) {
         return -1;
     }
 
@@ -201,14 +203,14 @@ static int isdirempty(struct inode *dp)
 }
 
 //PAGEBREAK!
-int sys_unlink(void)
+long sys_unlink(void)
 {
     struct inode *ip, *dp;
     struct dirent de;
-    char name[DIRSIZ], *path;
+    char name[DIRSIZ], path[MAXPATH];
     uint off;
 
-    if(argstr(0, &path) < 0) {
+    if(argstr(0, path, MAXPATH) < 0) {
         return -1;
     }
 
@@ -321,14 +323,14 @@ static struct inode* create(char *path, short type, short major, short minor)
     return ip;
 }
 
-int sys_open(void)
+long sys_open(void)
 {
-    char *path;
+    char path[MAXPATH];
     long fd, omode;
     struct file *f;
     struct inode *ip;
 
-    if(argstr(0, &path) < 0 || argint(1, &omode) < 0) {
+    if(argstr(0, path, MAXPATH) < 0 || argint(1, &omode) < 0) {
         return -1;
     }
 
@@ -374,14 +376,14 @@ int sys_open(void)
     return fd;
 }
 
-int sys_mkdir(void)
+long sys_mkdir(void)
 {
-    char *path;
+    char path[MAXPATH];
     struct inode *ip;
 
     begin_trans();
 
-    if(argstr(0, &path) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
+    if(argstr(0, path, MAXPATH) < 0 || (ip = create(path, T_DIR, 0, 0)) == 0){
         commit_trans();
         return -1;
     }
@@ -392,16 +394,16 @@ int sys_mkdir(void)
     return 0;
 }
 
-int sys_mknod(void)
+long sys_mknod(void)
 {
     struct inode *ip;
-    char *path;
+    char path[MAXPATH];
     int len;
     long major, minor;
 
     begin_trans();
 
-    if((len=argstr(0, &path)) < 0 ||
+    if((len=argstr(0, path, MAXPATH)) < 0 ||
             argint(1, &major) < 0 || argint(2, &minor) < 0 ||
             (ip = create(path, T_DEV, major, minor)) == 0){
 
@@ -415,12 +417,12 @@ int sys_mknod(void)
     return 0;
 }
 
-int sys_chdir(void)
+long sys_chdir(void)
 {
-    char *path;
+    char path[MAXPATH];
     struct inode *ip;
 
-    if(argstr(0, &path) < 0 || (ip = namei(path)) == 0) {
+    if(argstr(0, path, MAXPATH) < 0 || (ip = namei(path)) == 0) {
         return -1;
     }
 
@@ -439,20 +441,29 @@ int sys_chdir(void)
     return 0;
 }
 
-int sys_exec(void)
+// Fetch the nth system call argument as a user argv array of at
+// most MAXARG strings, terminated by a null pointer, and copy the
+// strings in, one after the other in *args, of MAXARGSZ bytes.
+// freeargv gives *args back, also when this fails.
+static int argargv(int n, char **argv, char **args)
 {
-    char *path, *argv[MAXARG];
-    int i;
-    uint64 uargv, uarg;
+    int i, len;
+    uint64 uargv, uarg, used;
+
+    *args = 0;
+
+    if(argint(n, (long*)&uargv) < 0){
+        return -1;
+    }
 
-    if(argstr(0, &path) < 0 || argint(1, (long*)&uargv) < 0){
+    if((*args = kmalloc(get_order(MAXARGSZ))) == 0){
         return -1;
     }
 
-    memset(argv, 0, sizeof(argv));
+    used = 0;
 
     for(i=0;; i++){
-        if(i >= NELEM(argv)) {
+        if(i >= MAXARG) {
             return -1;
         }
 
@@ -465,21 +476,89 @@ int sys_exec(void)
             break;
         }
 
-        if(fetchstr(uarg, &argv[i]) < 0) {
+        if((len = strncpy_from_user(*args + used, uarg, MAXARGSZ - used)) < 0) {
             return -1;
         }
+
+        argv[i] = *args + used;
+        used += len + 1;
     }
 
-    return exec(path, argv);
+    return 0;
 }
 
-int sys_pipe(void)
+static void freeargv(char *args)
 {
-    int *fd;
+    if(args != 0) {
+        kfree(args, get_order(MAXARGSZ));
+    }
+}
+
+long sys_exec(void)
+{
+    char path[MAXPATH], *argv[MAXARG], *args;
+    int ret;
+
+    ret = -1;
+    args = 0;
+
+    if(argstr(0, path, MAXPATH) >= 0 && argargv(1, argv, &args) >= 0){
+        ret = exec(path, argv);
+    }
+
+    freeargv(args);
+    return ret;
+}
+
+// spawn(path, argv, fds): fds is 0, or an array of three file
+// descriptors (or -1) that become 0, 1 and 2 of the child
+long sys_spawn(void)
+{
+    char path[MAXPATH], *argv[MAXARG], *args;
+    long ufds;
+    int fds[3], i, ret;
+    struct file *f[3];
+
+    ret = -1;
+    args = 0;
+
+    if(argstr(0, path, MAXPATH) < 0 || argargv(1, argv, &args) < 0 || argint(2, &ufds) < 0){
+        goto out;
+    }
+
+    if(ufds == 0) {
+        ret = spawn(path, argv, 0);
+        goto out;
+    }
+
+    if(copy_from_user(fds, ufds, sizeof(fds)) < 0) {
+        goto out;
+    }
+
+    for(i = 0; i < 3; i++){
+        if(fds[i] == -1) {
+            f[i] = 0;
+
+        } else if(fds[i] < 0 || fds[i] >= NOFILE || (f[i] = proc->ofile[fds[i]]) == 0) {
+            goto out;
+        }
+    }
+
+    ret = spawn(path, argv, f);
+
+out:
+    freeargv(args);
+    return ret;
+}
+
+long sys_pipe(void)
+{
+    long ufd;
+    int fd[2];
     struct file *rf, *wf;
     int fd0, fd1;
 
-    if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0) {
+    if(argint(0, &ufd) < 0) {
         return -1;
     }
 
@@ -503,5 +582,71 @@ int sys_pipe(void)
     fd[0] = fd0;
     fd[1] = fd1;
 
+    if(copy_to_user(ufd, fd, sizeof(fd)) < 0){
+        proc->ofile[fd0] = 0;
+        proc->ofile[fd1] = 0;
+
+        fileclose(rf);
+        fileclose(wf);
+
+        return -1;
+    }
+
     return 0;
 }
+
+// shmget(key, size): open the shared memory segment of key (0 for a
+// new, unnamed one) as a file descriptor, for mmap to attach
+long sys_shmget(void)
+{
+    long key, size;
+    struct shm *s;
+    struct file *f;
+    int fd;
+
+    if(argint(0, &key) < 0 || argint(1, &size) < 0) {
+        return -1;
+    }
+
+    if((s = shm_get(key, size)) == 0) {
+        return -1;
+    }
+
+    if((f = filealloc()) == 0){
+        shm_put(s);
+        return -1;
+    }
+
+    // neither read nor write work on it, only mmap
+    f->type = FD_SHM;
+    f->shm = s;
+    f->readable = 0;
+    f->writable = 0;
+
+    if((fd = fdalloc(f)) < 0){
+        fileclose(f);
+        return -1;
+    }
+
+    return fd;
+}
+
+// mmap(addr, len, prot, flags, fd, off): fd is ignored with MAP_ANONYMOUS
+long sys_mmap(void)
+{
+    long addr, len, prot, flags, off;
+    struct file *f;
+
+    if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 ||
+       argint(3, &flags) < 0 || argint(5, &off) < 0){
+        return -1;
+    }
+
+    f = 0;
+
+    if(!(flags & MAP_ANONYMOUS) && argfd(4, 0, &f) < 0) {
+        return -1;
+    }
+
+    return mmap(addr, len, prot, flags, f, off);
+}
@@ -5,24 +5,25 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "kmemstat.h"
 
-int sys_fork(void)
+long sys_fork(void)
 {
     return fork();
 }
 
-int sys_exit(void)
+long sys_exit(void)
 {
     exit();
     return 0;  // not reached
 }
 
-int sys_wait(void)
+long sys_wait(void)
 {
     return wait();
 }
 
-int sys_kill(void)
+long sys_kill(void)
 {
     long pid;
 
@@ -33,12 +34,12 @@ int sys_kill(void)
     return kill(pid);
 }
 
-int sys_getpid(void)
+long sys_getpid(void)
 {
     return proc->pid;
 }
 
-int sys_sbrk(void)
+long sys_sbrk(void)
 {
     long addr;
     long n;
@@ -56,7 +57,29 @@ int sys_sbrk(void)
     return addr;
 }
 
-int sys_sleep(void)
+long sys_munmap(void)
+{
+    long addr, len;
+
+    if(argint(0, &addr) < 0 || argint(1, &len) < 0) {
+        return -1;
+    }
+
+    return munmap(addr, len);
+}
+
+long sys_mprotect(void)
+{
+    long addr, len, prot;
+
+    if(argint(0, &addr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0) {
+        return -1;
+    }
+
+    return mprotect(addr, len, prot);
+}
+
+long sys_sleep(void)
 {
     long n;
     uint ticks0;
@@ -84,7 +107,7 @@ int sys_sleep(void)
 
 // return how many clock tick interrupts have occurred
 // since start.
-int sys_uptime(void)
+long sys_uptime(void)
 {
     uint xticks;
 
@@ -94,3 +117,29 @@ int sys_uptime(void)
 
     return xticks;
 }
+
+// copy the kernel memory statistics to user space
+long sys_kmemstat(void)
+{
+    struct kmemstat *st;
+    long p;
+    int order, ret;
+
+    if(argint(0, &p) < 0) {
+        return -1;
+    }
+
+    // too big for the kernel stack
+    order = get_order(sizeof(*st));
+
+    if((st = kmalloc(order)) == NULL) {
+        return -1;
+    }
+
+    kmem_stat(st);
+    thp_stat(st);
+    ret = copy_to_user(p, st, sizeof(*st));
+    kfree(st, order);
+
+    return ret;
+}
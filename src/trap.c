@@ -4,6 +4,7 @@
 #include "param.h"
 #include "arm.h"
 #include "proc.h"
+#include "mmu.h"
 
 // trap routine
 void swi_handler (struct trapframe *r, uint32 el)
@@ -25,30 +26,103 @@ void irq_handler (struct trapframe *r, uint32 el, uint32 esr)
     pic_dispatch (r);
 }
 
+// An entry of the exception table: a kernel instruction that accesses
+// user memory, and where to continue if that faults (see uaccess.S)
+struct exentry {
+    uint64  insn;
+    uint64  fixup;
+};
+
+extern struct exentry __ex_table[], __ex_table_end[];
+
+// Continue at the fixup of the faulting instruction of r, if it has
+// one. Returns -1 if it has not.
+static int fixup_exception (struct trapframe *r)
+{
+    struct exentry *e;
+
+    for (e = __ex_table; e < __ex_table_end; e++) {
+        if (e->insn == r->elr) {
+            r->elr = e->fixup;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
 // trap routine
 void dabort_handler (struct trapframe *r, uint32 el, uint32 esr)
 {
     uint64 fa;
+    uint32 fsc;
     extern void show_callstk (char *s);
-    cli();
 
     // read the fault address register
     asm("MRS %[r], FAR_EL1": [r]"=r" (fa)::);
-    
-    cprintf ("data abort: instruction 0x%x, fault addr 0x%x\n",
-             r->elr, fa);
-  
+
+    // faults on the user part of the current process, by the process
+    // or by the kernel on its behalf (e.g., read into a buffer): the
+    // first touch of a page that exec, sbrk or mmap only reserved, a
+    // write to a copy-on-write or clean page, or the first access since
+    // the page was aged without the MMU setting the access flag
+    if ((proc != NULL) && (fa < UADDR_SZ)) {
+        fsc = FSC_TYPE(ESR_FSC(esr));
+
+        if (((fsc == FSC_TRANS) || (fsc == FSC_PERM) || (fsc == FSC_ACCESS)) &&
+            (pagefault(proc, fa, (esr & ESR_WNR) != 0) == 0)) {
+            return;
+        }
+    }
+
+    // a bad user address given to the kernel fails the system call
+    if ((el != 0) && (fixup_exception(r) == 0)) {
+        return;
+    }
+
+    cli();
+
+    cprintf ("data abort: instruction 0x%x, fault addr 0x%x, esr 0x%x\n",
+             r->elr, fa, (uint64)esr);
+
     dump_trapframe (r);
     //show_callstk("Stack dump for data exception.");
+
+    if ((el == 0) && (proc != NULL)) {
+        proc->killed = 1;
+        exit();
+    }
+
+    panic("data abort in kernel");
 }
 
 // trap routine
 void iabort_handler (struct trapframe *r, uint32 el, uint32 esr)
 {
+    uint64 fa;
+
+    asm("MRS %[r], FAR_EL1": [r]"=r" (fa)::);
+
+    // the first instruction fetched from a page of the program, or from
+    // one that was aged (see dabort_handler). A permission fault is an
+    // attempt to run a page without PROT_EXEC.
+    if ((el == 0) && (proc != NULL) && (fa < UADDR_SZ) &&
+        ((FSC_TYPE(ESR_FSC(esr)) == FSC_TRANS) || (FSC_TYPE(ESR_FSC(esr)) == FSC_ACCESS)) &&
+        (pagefault(proc, fa, 0) == 0)) {
+        return;
+    }
+
     cli();
     cprintf ("prefetch abort at: 0x%x\n", r->elr);
 
     dump_trapframe (r);
+
+    if ((el == 0) && (proc != NULL)) {
+        proc->killed = 1;
+        exit();
+    }
+
+    panic("prefetch abort in kernel");
 }
 
 // trap routine
@@ -105,7 +179,13 @@ void default_handler (struct trapframe *r, uint32 el, uint32 esr)
 // to flash during startup, we need to remap it to SDRAM
 void trap_init ( )
 {
-    //Nothing to do
+    uint64 val;
+
+    // let user programs read the virtual counter (CNTKCTL_EL1.EL0VCTEN)
+    // to time themselves, see usr/forkbench.c
+    asm("MRS %[r], CNTKCTL_EL1": [r]"=r" (val)::);
+    val |= (1 << 1);
+    asm("MSR CNTKCTL_EL1, %[v]": :[v]"r" (val):);
 }
 
 void dump_trapframe (struct trapframe *tf)
@@ -0,0 +1,79 @@
+// forkbench: time fork+exec+wait for a range of parent sizes
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NRUN 16
+
+// parent sizes, in KB
+static int sizes[] = { 0, 64, 256, 1024, 4096, 16384 };
+
+// the kernel lets user code read the virtual counter, see trap_init
+static uint64
+cntvct(void)
+{
+    uint64 v;
+
+    asm volatile("isb; mrs %0, cntvct_el0" : "=r" (v));
+    return v;
+}
+
+static uint64
+cntfrq(void)
+{
+    uint64 v;
+
+    asm volatile("mrs %0, cntfrq_el0" : "=r" (v));
+    return v;
+}
+
+int
+main(int argc, char *argv[])
+{
+    char *args[] = { "forkbench", "-child", 0 };
+    char *base, *p;
+    uint64 t0, us;
+    int i, j, pid;
+
+    // the exec'd child has nothing to do
+    if(argc > 1)
+        exit();
+
+    base = sbrk(0);
+
+    printf(1, "parent-KB  us/fork+exec+wait (%d runs)\n", NRUN);
+
+    for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+        p = sbrk(0);
+        if(sbrk(base + sizes[i] * 1024 - p) == (char*)-1){
+            printf(1, "forkbench: sbrk failed\n");
+            exit();
+        }
+
+        // touch the new memory so that all of it is mapped
+        for(; p < base + sizes[i] * 1024; p += 4096)
+            *p = 1;
+
+        t0 = cntvct();
+
+        for(j = 0; j < NRUN; j++){
+            pid = fork();
+            if(pid < 0){
+                printf(1, "forkbench: fork failed\n");
+                exit();
+            }
+            if(pid == 0){
+                exec("forkbench", args);
+                printf(1, "forkbench: exec failed\n");
+                exit();
+            }
+            wait();
+        }
+
+        us = (cntvct() - t0) * 1000000 / cntfrq() / NRUN;
+        printf(1, "%d  %d\n", sizes[i], (int)us);
+    }
+
+    exit();
+}
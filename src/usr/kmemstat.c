@@ -0,0 +1,92 @@
+// kmemstat: report kernel memory usage, fragmentation and, if the
+// kernel is built with CONFIG_KMEM_PROF, the busiest allocation sites
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "kmemstat.h"
+
+struct kmemstat st;
+
+static void
+puthex(uint64 v)
+{
+    static char digits[] = "0123456789abcdef";
+    char buf[16];
+    int i;
+
+    for(i = 15; i >= 0; i--){
+        buf[i] = digits[v & 0xf];
+        v >>= 4;
+    }
+
+    write(1, buf, sizeof(buf));
+}
+
+// fraction (in 1/1000) of the free memory that cannot serve a request
+// of the given order because it is in smaller blocks
+static int
+fragindex(int order)
+{
+    uint64 usable;
+    int i;
+
+    if(st.free_bytes == 0)
+        return 0;
+
+    usable = 0;
+    for(i = order; i < KMS_NORDER; i++)
+        usable += st.nfree[i] << (i + KMS_MIN_ORDER);
+
+    return (st.free_bytes - usable) * 1000 / st.free_bytes;
+}
+
+int
+main(void)
+{
+    struct kmemsite t;
+    int i, j;
+
+    if(kmemstat(&st) < 0){
+        printf(2, "kmemstat: failed\n");
+        exit();
+    }
+
+    printf(1, "free %d KB of %d KB\n", st.free_bytes >> 10, st.total_bytes >> 10);
+    printf(1, "order  size     free-blocks  frag/1000\n");
+
+    for(i = 0; i < KMS_NORDER; i++){
+        printf(1, "%d     %d  %d  %d\n", i + KMS_MIN_ORDER,
+               1 << (i + KMS_MIN_ORDER), st.nfree[i], fragindex(i));
+    }
+
+    printf(1, "huge pages: %d mapped, %d allocs, %d splits, %d fallbacks\n",
+           st.thp_mapped, st.thp_allocs, st.thp_splits, st.thp_fallbacks);
+
+    if(!st.profiling){
+        printf(1, "no call site profile (kernel built without CONFIG_KMEM_PROF)\n");
+        exit();
+    }
+
+    // busiest sites first
+    for(i = 1; i < st.nsite; i++){
+        t = st.sites[i];
+        for(j = i; j > 0 && st.sites[j-1].alloc_bytes + st.sites[j-1].free_bytes <
+                            t.alloc_bytes + t.free_bytes; j--)
+            st.sites[j] = st.sites[j-1];
+        st.sites[j] = t;
+    }
+
+    printf(1, "call site         allocs  alloc-KB  frees  free-KB\n");
+
+    for(i = 0; i < st.nsite; i++){
+        puthex(st.sites[i].pc);
+        printf(1, "  %d  %d  %d  %d\n", st.sites[i].allocs, st.sites[i].alloc_bytes >> 10,
+               st.sites[i].frees, st.sites[i].free_bytes >> 10);
+    }
+
+    if(st.dropped)
+        printf(1, "%d calls from sites that did not fit the table\n", st.dropped);
+
+    exit();
+}
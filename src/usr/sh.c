@@ -52,6 +52,7 @@ struct backcmd {
 int fork1(void);  // Fork but panics on failure.
 void panic(char*);
 struct cmd *parsecmd(char*);
+int gettoken(char**, char*, char**, char**);
 
 // Execute cmd.  Never returns.
 void
@@ -130,6 +131,102 @@ runcmd(struct cmd *cmd)
     exit();
 }
 
+// Can the command line s be run with spawn? It must be a simple command
+// or a pipeline of them: only words and '|', with no empty command and
+// not too many arguments, so that parsecmd cannot fail in the shell.
+int
+spawnable(char *s)
+{
+    char *es;
+    int tok, nword;
+    
+    es = s + strlen(s);
+    nword = 0;
+    while((tok = gettoken(&s, es, 0, 0)) != 0){
+        if(tok == 'a'){
+            if(++nword >= MAXARGS)
+                return 0;
+        } else if(tok == '|' && nword > 0){
+            nword = 0;
+        } else {
+            return 0;
+        }
+    }
+    return nword > 0;
+}
+
+// Start cmd, a command line accepted by spawnable, with fds 0 and 1
+// of its commands set to in and out. No copy of the shell is made.
+// Returns the number of processes started.
+int
+spawncmd(struct cmd *cmd, int in, int out)
+{
+    int p[2], fds[3], n;
+    struct execcmd *ecmd;
+    struct pipecmd *pcmd;
+    
+    if(cmd->type == EXEC){
+        ecmd = (struct execcmd*)cmd;
+        fds[0] = in;
+        fds[1] = out;
+        fds[2] = 2;
+        if(spawn(ecmd->argv[0], ecmd->argv, fds) < 0){
+            printf(2, "exec %s failed\n", ecmd->argv[0]);
+            return 0;
+        }
+        return 1;
+    }
+    
+    pcmd = (struct pipecmd*)cmd;
+    if(pipe(p) < 0){
+        printf(2, "pipe failed\n");
+        return 0;
+    }
+    n = spawncmd(pcmd->left, in, p[1]);
+    close(p[1]);
+    n += spawncmd(pcmd->right, p[0], out);
+    close(p[0]);
+    return n;
+}
+
+// Free a command parsed in the shell itself.
+void
+freecmd(struct cmd *cmd)
+{
+    struct backcmd *bcmd;
+    struct listcmd *lcmd;
+    struct pipecmd *pcmd;
+    struct redircmd *rcmd;
+    
+    if(cmd == 0)
+        return;
+    
+    switch(cmd->type){
+        case REDIR:
+            rcmd = (struct redircmd*)cmd;
+            freecmd(rcmd->cmd);
+            break;
+            
+        case PIPE:
+            pcmd = (struct pipecmd*)cmd;
+            freecmd(pcmd->left);
+            freecmd(pcmd->right);
+            break;
+            
+        case LIST:
+            lcmd = (struct listcmd*)cmd;
+            freecmd(lcmd->left);
+            freecmd(lcmd->right);
+            break;
+            
+        case BACK:
+            bcmd = (struct backcmd*)cmd;
+            freecmd(bcmd->cmd);
+            break;
+    }
+    free(cmd);
+}
+
 int
 getcmd(char *buf, int nbuf)
 {
@@ -145,7 +242,8 @@ int
 main(void)
 {
     static char buf[100];
-    int fd;
+    struct cmd *cmd;
+    int fd, n;
     
     // Assumes three file descriptors open.
     while((fd = open("console", O_RDWR)) >= 0){
@@ -165,6 +263,14 @@ main(void)
                 printf(2, "cannot cd %s\n", buf+3);
             continue;
         }
+        if(spawnable(buf)){
+            // Simple commands and pipelines need no copy of the shell.
+            cmd = parsecmd(buf);
+            for(n = spawncmd(cmd, 0, 1); n > 0; n--)
+                wait();
+            freecmd(cmd);
+            continue;
+        }
         if(fork1() == 0)
             runcmd(parsecmd(buf));
         wait();
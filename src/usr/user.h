@@ -1,4 +1,5 @@
 struct stat;
+struct kmemstat;
 
 // vararg support (FIXME: re-organise all of this...)
 typedef __builtin_va_list va_list;
@@ -25,9 +26,15 @@ int mkdir(char*);
 int chdir(char*);
 int dup(int);
 int getpid(void);
-char* sbrk(int);
+char* sbrk(long);
 int sleep(int);
 int uptime(void);
+int kmemstat(struct kmemstat*);
+int spawn(char*, char**, int*);
+void* mmap(void*, uint64, int, int, int, uint64);
+int munmap(void*, uint64);
+int mprotect(void*, uint64, int);
+int shmget(int, uint);
 
 // ulib.c
 int stat(char*, struct stat*);
@@ -6,6 +6,9 @@
 #include "fcntl.h"
 #include "syscall.h"
 #include "memlayout.h"
+#include "mmu.h"
+#include "mman.h"
+#include "kmemstat.h"
 
 char buf[8192];
 char name[3];
@@ -189,6 +192,44 @@ void dirtest(void)
     printf(stdout, "mkdir test\n");
 }
 
+// spawn echo with its output going into a pipe
+void
+spawntest(void)
+{
+    static char buf[64];
+    int p[2], fds[3], pid, n, tot;
+    
+    printf(stdout, "spawn test\n");
+    
+    if(pipe(p) != 0){
+        printf(stdout, "pipe() failed\n");
+        exit();
+    }
+    fds[0] = -1;
+    fds[1] = p[1];
+    fds[2] = -1;
+    pid = spawn("echo", echoargv, fds);
+    close(p[1]);
+    if(pid < 0){
+        printf(stdout, "spawn echo failed\n");
+        exit();
+    }
+    tot = 0;
+    while((n = read(p[0], buf + tot, sizeof(buf) - 1 - tot)) > 0)
+        tot += n;
+    close(p[0]);
+    buf[tot] = 0;
+    if(wait() != pid || strcmp(buf, "ALL TESTS PASSED\n") != 0){
+        printf(stdout, "spawn test: wrong output %s\n", buf);
+        exit();
+    }
+    if(spawn("nosuchprogram", echoargv, 0) >= 0){
+        printf(stdout, "spawn of a missing program succeeded\n");
+        exit();
+    }
+    printf(stdout, "spawn test ok\n");
+}
+
 void
 exectest(void)
 {
@@ -253,6 +294,42 @@ pipe1(void)
     printf(1, "pipe1 ok\n");
 }
 
+// several pipes at once, back to back: pipes come from a slab cache,
+// and each must still be usable when it is not the first object free
+#define NPIPES 6
+void
+pipe2(void)
+{
+    int fds[NPIPES][2];
+    int round, i;
+    char c;
+
+    for(round = 0; round < 4; round++){
+        for(i = 0; i < NPIPES; i++){
+            if(pipe(fds[i]) != 0){
+                printf(1, "pipe2 pipe() failed\n");
+                exit();
+            }
+        }
+        for(i = 0; i < NPIPES; i++){
+            c = 'a' + i;
+            if(write(fds[i][1], &c, 1) != 1){
+                printf(1, "pipe2 write failed\n");
+                exit();
+            }
+        }
+        for(i = 0; i < NPIPES; i++){
+            if(read(fds[i][0], &c, 1) != 1 || c != 'a' + i){
+                printf(1, "pipe2 read failed\n");
+                exit();
+            }
+            close(fds[i][0]);
+            close(fds[i][1]);
+        }
+    }
+    printf(1, "pipe2 ok\n");
+}
+
 // meant to be run w/ at most two CPUs
 void
 preempt(void)
@@ -1312,6 +1389,473 @@ forktest(void)
     printf(1, "fork test OK\n");
 }
 
+// fork shares memory copy-on-write. A write on either side, by the
+// process or by the kernel (read into a buffer), must stay private.
+#define COWSZ (8*4096)
+
+void
+cowtest(void)
+{
+    int fds[2], i, pid;
+    char *p;
+
+    printf(stdout, "cow test\n");
+
+    p = sbrk(COWSZ);
+    for(i = 0; i < COWSZ; i++)
+        p[i] = i;
+
+    if(pipe(fds) != 0){
+        printf(stdout, "cow test: pipe failed\n");
+        exit();
+    }
+    write(fds[1], "y", 1);
+
+    pid = fork();
+    if(pid < 0){
+        printf(stdout, "cow test: fork failed\n");
+        exit();
+    }
+    if(pid == 0){
+        if(read(fds[0], p + 1, 1) != 1 || p[1] != 'y'){
+            printf(stdout, "cow test: child read failed\n");
+            exit();
+        }
+        for(i = 0; i < COWSZ; i += 4096)
+            p[i] = 'c';
+        for(i = 2; i < COWSZ; i++){
+            if(i % 4096 != 0 && p[i] != (char)i){
+                printf(stdout, "cow test: child sees wrong data\n");
+                exit();
+            }
+        }
+        exit();
+    }
+    wait();
+    close(fds[0]);
+    close(fds[1]);
+
+    for(i = 0; i < COWSZ; i++){
+        if(p[i] != (char)i){
+            printf(stdout, "cow test: parent sees the child's writes\n");
+            exit();
+        }
+    }
+
+    sbrk(-COWSZ);
+    printf(stdout, "cow test OK\n");
+}
+
+// program text is read-only, for user code and for system calls
+void
+texttest(void)
+{
+    int fds[2], pid, ppid;
+    char *text;
+    
+    printf(stdout, "text test\n");
+    text = (char*)texttest;
+    if(pipe(fds) != 0){
+        printf(stdout, "pipe() failed\n");
+        exit();
+    }
+    write(fds[1], "x", 1);
+    if(read(fds[0], text, 1) != -1){
+        printf(stdout, "read into program text succeeded\n");
+        exit();
+    }
+    close(fds[0]);
+    close(fds[1]);
+    
+    ppid = getpid();
+    pid = fork();
+    if(pid < 0){
+        printf(stdout, "fork failed\n");
+        exit();
+    }
+    if(pid == 0){
+        *text = 0;
+        printf(stdout, "oops could write program text\n");
+        kill(ppid);
+        exit();
+    }
+    wait();
+    printf(stdout, "text test OK\n");
+}
+
+// sbrk only reserves memory; pages appear, zeroed, when first touched
+// by the program, by a forked child, or by the kernel in a system call
+#define LAZYSZ (32*1024*1024)
+void
+lazytest(void)
+{
+    char *a, *oldbrk;
+    int fds[2], i, pid;
+    
+    printf(stdout, "lazy sbrk test\n");
+    oldbrk = sbrk(0);
+    a = sbrk(LAZYSZ);
+    if(a == (char*)0xffffffff){
+        printf(stdout, "lazy sbrk failed\n");
+        exit();
+    }
+    for(i = 0; i < LAZYSZ; i += 1024*1024){
+        if(a[i] != 0){
+            printf(stdout, "lazy sbrk page not zeroed\n");
+            exit();
+        }
+        a[i] = i >> 20;
+    }
+    pid = fork();
+    if(pid < 0){
+        printf(stdout, "lazy sbrk fork failed\n");
+        exit();
+    }
+    if(pid == 0){
+        for(i = 0; i < LAZYSZ; i += 1024*1024){
+            if(a[i] != (char)(i >> 20) || a[i + 4096] != 0){
+                printf(stdout, "lazy sbrk wrong data in child\n");
+                exit();
+            }
+        }
+        exit();
+    }
+    wait();
+    
+    // the kernel reads from and writes to pages nobody touched yet
+    if(pipe(fds) != 0){
+        printf(stdout, "pipe() failed\n");
+        exit();
+    }
+    if(write(fds[1], a + LAZYSZ - 4096, 1) != 1 ||
+       read(fds[0], a + LAZYSZ - 2*4096, 1) != 1 ||
+       a[LAZYSZ - 2*4096] != 0){
+        printf(stdout, "lazy sbrk system call failed\n");
+        exit();
+    }
+    close(fds[0]);
+    close(fds[1]);
+    
+    sbrk(-(sbrk(0) - oldbrk));
+    printf(stdout, "lazy sbrk test OK\n");
+}
+
+// anonymous memory that covers an aligned level 2 block (2MB with 4KB
+// pages) is mapped with huge pages, which are split into pages again
+// when only part of one is unmapped
+#define HUGESZ PMD_SZ
+void
+hugetest(void)
+{
+    static struct kmemstat st;
+    char *a, *h;
+    uint64 mapped, fallbacks, splits;
+    int i, huge;
+
+    printf(stdout, "huge page test\n");
+    if(PMD_ORDER > MAX_PAGE_ORDER){
+        printf(stdout, "no huge pages with this granule\n");
+        return;
+    }
+    a = mmap(0, 2*HUGESZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(a == MAP_FAILED){
+        printf(stdout, "mmap failed\n");
+        exit();
+    }
+    h = (char*)(((uint64)a + HUGESZ - 1) & ~(uint64)(HUGESZ - 1));
+    kmemstat(&st);
+    mapped = st.thp_mapped;
+    fallbacks = st.thp_fallbacks;
+    splits = st.thp_splits;
+    for(i = 0; i < HUGESZ; i += PTE_SZ)
+        h[i] = i / PTE_SZ;
+    kmemstat(&st);
+    // without a free 2MB block, the kernel maps pages instead
+    huge = st.thp_mapped > mapped;
+    if(!huge && st.thp_fallbacks == fallbacks){
+        printf(stdout, "touching a block did not map a huge page\n");
+        exit();
+    }
+    if(munmap(h + PTE_SZ, PTE_SZ) != 0){
+        printf(stdout, "munmap failed\n");
+        exit();
+    }
+    kmemstat(&st);
+    if(huge && st.thp_splits == splits){
+        printf(stdout, "partial munmap did not split the huge page\n");
+        exit();
+    }
+    for(i = 2*PTE_SZ; i < HUGESZ; i += PTE_SZ){
+        if(h[i] != (char)(i / PTE_SZ)){
+            printf(stdout, "huge page data lost by split\n");
+            exit();
+        }
+    }
+    munmap(a, 2*HUGESZ);
+    printf(stdout, "huge page test OK\n");
+}
+
+// anonymous and file mappings: private ones are copied on write, also
+// across fork; shared ones reach the file when unmapped
+#define MMAPFSZ 6000
+void
+mmaptest(void)
+{
+    char *a, *f;
+    int fd, i, pid, ppid;
+
+    printf(stdout, "mmap test\n");
+    a = mmap(0, 3*4096, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(a == MAP_FAILED){
+        printf(stdout, "mmap anonymous failed\n");
+        exit();
+    }
+    for(i = 0; i < 3*4096; i += 512){
+        if(a[i] != 0){
+            printf(stdout, "mmap anonymous page not zeroed\n");
+            exit();
+        }
+        a[i] = i / 512;
+    }
+    pid = fork();
+    if(pid < 0){
+        printf(stdout, "mmap fork failed\n");
+        exit();
+    }
+    if(pid == 0){
+        if(a[4096] != 8){
+            printf(stdout, "mmap wrong data in child\n");
+            exit();
+        }
+        a[4096] = 'c';
+        exit();
+    }
+    wait();
+    if(a[4096] != 8){
+        printf(stdout, "mmap child write seen by parent\n");
+        exit();
+    }
+
+    // system calls can use mapped buffers
+    fd = open("mmapfile", O_CREATE|O_RDWR);
+    if(fd < 0){
+        printf(stdout, "mmap create file failed\n");
+        exit();
+    }
+    for(i = 0; i < MMAPFSZ; i++){
+        a[i] = 'a' + i % 26;
+    }
+    if(write(fd, a, MMAPFSZ) != MMAPFSZ){
+        printf(stdout, "mmap write from mapping failed\n");
+        exit();
+    }
+    close(fd);
+
+    // read-only after mprotect
+    if(mprotect(a, 4096, PROT_READ) != 0){
+        printf(stdout, "mprotect failed\n");
+        exit();
+    }
+    ppid = getpid();
+    pid = fork();
+    if(pid < 0){
+        printf(stdout, "mmap fork failed\n");
+        exit();
+    }
+    if(pid == 0){
+        a[0] = 0;
+        printf(stdout, "oops could write PROT_READ page\n");
+        kill(ppid);
+        exit();
+    }
+    wait();
+    if(munmap(a, 3*4096) != 0){
+        printf(stdout, "munmap failed\n");
+        exit();
+    }
+
+    fd = open("mmapfile", O_RDWR);
+    f = mmap(0, MMAPFSZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if(f == MAP_FAILED){
+        printf(stdout, "mmap private file failed\n");
+        exit();
+    }
+    for(i = 0; i < 8192; i++){
+        if(f[i] != (i < MMAPFSZ ? 'a' + i % 26 : 0)){
+            printf(stdout, "mmap private file wrong data\n");
+            exit();
+        }
+    }
+    f[0] = 'X';
+    munmap(f, MMAPFSZ);
+
+    f = mmap(0, MMAPFSZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(f == MAP_FAILED || f[0] != 'a'){
+        printf(stdout, "mmap shared file failed\n");
+        exit();
+    }
+    // the child dirties a page the parent only read; a page written
+    // before it was made read-only is still written back
+    pid = fork();
+    if(pid < 0){
+        printf(stdout, "mmap fork failed\n");
+        exit();
+    }
+    if(pid == 0){
+        f[2] = 'W';
+        exit();
+    }
+    wait();
+    f[1] = 'Y';
+    f[5000] = 'Z';
+    if(mprotect((char*)((uint64)(f + 5000) & ~(PTE_SZ - 1)), PTE_SZ, PROT_READ) != 0){
+        printf(stdout, "mprotect shared file failed\n");
+        exit();
+    }
+    munmap(f, MMAPFSZ);
+    close(fd);
+
+    fd = open("mmapfile", O_RDONLY);
+    if(read(fd, buf, MMAPFSZ) != MMAPFSZ || buf[0] != 'a' || buf[1] != 'Y' || buf[2] != 'W' ||
+       buf[5000] != 'Z'){
+        printf(stdout, "mmap shared file not written back\n");
+        exit();
+    }
+    if(mmap(0, 4096, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != MAP_FAILED){
+        printf(stdout, "mmap shared writable read-only file\n");
+        exit();
+    }
+    close(fd);
+    unlink("mmapfile");
+    printf(stdout, "mmap test OK\n");
+}
+
+// shared memory segments: a keyed one that parent and child attach on
+// their own, and one the child inherits mapped; both see each other's
+// writes without copying
+#define SHMKEY 1234
+void
+shmtest(void)
+{
+    char *a, *b;
+    int fd, pfd, pid;
+
+    printf(stdout, "shm test\n");
+    fd = shmget(SHMKEY, 2*PTE_SZ);
+    if(fd < 0){
+        printf(stdout, "shmget failed\n");
+        exit();
+    }
+    a = mmap(0, 2*PTE_SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(a == MAP_FAILED){
+        printf(stdout, "mmap shm failed\n");
+        exit();
+    }
+    if(mmap(0, PTE_SZ, PROT_READ, MAP_PRIVATE, fd, 0) != MAP_FAILED ||
+       mmap(0, 3*PTE_SZ, PROT_READ, MAP_SHARED, fd, 0) != MAP_FAILED){
+        printf(stdout, "mmap shm private or past its end\n");
+        exit();
+    }
+    pfd = shmget(0, PTE_SZ);
+    b = mmap(0, PTE_SZ, PROT_READ|PROT_WRITE, MAP_SHARED, pfd, 0);
+    if(pfd < 0 || b == MAP_FAILED){
+        printf(stdout, "private shm failed\n");
+        exit();
+    }
+    close(pfd);
+    a[0] = 'p';
+    b[0] = 'p';
+    pid = fork();
+    if(pid < 0){
+        printf(stdout, "shm fork failed\n");
+        exit();
+    }
+    if(pid == 0){
+        munmap(a, 2*PTE_SZ);
+        close(fd);
+        fd = shmget(SHMKEY, PTE_SZ);
+        a = mmap(0, 2*PTE_SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if(fd < 0 || a == MAP_FAILED || a[0] != 'p' || b[0] != 'p'){
+            printf(stdout, "shm not seen by child\n");
+            exit();
+        }
+        a[PTE_SZ] = 'c';
+        b[1] = 'c';
+        exit();
+    }
+    wait();
+    if(a[PTE_SZ] != 'c' || b[1] != 'c'){
+        printf(stdout, "shm child write not seen by parent\n");
+        exit();
+    }
+    if(read(fd, a, 1) != -1){
+        printf(stdout, "read of shm fd worked\n");
+        exit();
+    }
+    munmap(a, 2*PTE_SZ);
+    munmap(b, PTE_SZ);
+    close(fd);
+
+    // gone with its last file and mapping: a new one starts out zeroed
+    fd = shmget(SHMKEY, PTE_SZ);
+    a = mmap(0, PTE_SZ, PROT_READ, MAP_SHARED, fd, 0);
+    if(fd < 0 || a == MAP_FAILED || a[0] != 0){
+        printf(stdout, "shm outlived its last user\n");
+        exit();
+    }
+    munmap(a, PTE_SZ);
+    close(fd);
+    printf(stdout, "shm test OK\n");
+}
+
+// sizes are 64-bit: the heap and mappings can span several gigabytes,
+// of which only the pages touched take memory
+#define BIGVASZ (6ULL << 30)
+void
+bigvatest(void)
+{
+    char *a, *oldbrk;
+
+    printf(stdout, "big address space test\n");
+    if(UADDR_SZ < 4*BIGVASZ){
+        printf(stdout, "user address space too small\n");
+        return;
+    }
+    a = mmap(0, BIGVASZ, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(a == MAP_FAILED || (uint64)a < UMMAP_BASE){
+        printf(stdout, "big mmap failed\n");
+        exit();
+    }
+    a[0] = 1;
+    a[BIGVASZ/2] = 2;
+    a[BIGVASZ-1] = 3;
+    if(a[0] != 1 || a[BIGVASZ/2] != 2 || a[BIGVASZ-1] != 3 || a[BIGVASZ-2] != 0){
+        printf(stdout, "big mmap wrong data\n");
+        exit();
+    }
+    if(munmap(a, BIGVASZ) != 0){
+        printf(stdout, "big munmap failed\n");
+        exit();
+    }
+
+    oldbrk = sbrk(0);
+    if(sbrk(BIGVASZ) != oldbrk){
+        printf(stdout, "big sbrk failed\n");
+        exit();
+    }
+    oldbrk[BIGVASZ-1] = 4;
+    if(oldbrk[BIGVASZ-1] != 4 || oldbrk[BIGVASZ/2] != 0){
+        printf(stdout, "big sbrk wrong data\n");
+        exit();
+    }
+    sbrk(-BIGVASZ);
+    if(sbrk(0) != oldbrk){
+        printf(stdout, "big sbrk did not shrink\n");
+        exit();
+    }
+    printf(stdout, "big address space test OK\n");
+}
+
 void
 sbrktest(void)
 {
@@ -1457,6 +2001,7 @@ validatetest(void)
 {
     int hi, pid;
     uint64 p;
+    char *ro;
     
     printf(stdout, "validate test\n");
     hi = 1100*1024;
@@ -1479,6 +2024,20 @@ validatetest(void)
         }
     }
     
+    // the kernel copies to and from user memory as the process would:
+    // kernel, unreserved and read-only addresses fail the call
+    ro = mmap(0, 4096, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(ro == MAP_FAILED){
+        printf(stdout, "mmap failed\n");
+        exit();
+    }
+    if(pipe((int*)KERNBASE) != -1 || open((char*)(UMMAP_BASE - 4096), 0) != -1 ||
+       fstat(0, (struct stat*)ro) != -1){
+        printf(stdout, "system call used a bad pointer\n");
+        exit();
+    }
+    munmap(ro, 4096);
+    
     printf(stdout, "validate ok\n");
 }
 
@@ -1612,6 +2171,12 @@ main(int argc, char *argv[])
     bigargtest();
     bsstest();
     sbrktest();
+    lazytest();
+    mmaptest();
+    hugetest();
+    shmtest();
+    bigvatest();
+    texttest();
     validatetest();
     
     opentest();
@@ -1621,6 +2186,7 @@ main(int argc, char *argv[])
     
     mem();
     pipe1();
+    pipe2();
     //preempt();
     exitwait();
     
@@ -1638,6 +2204,8 @@ main(int argc, char *argv[])
     dirfile();
     iref();
     forktest();
+    cowtest();
+    spawntest();
     bigdir(); // slow
     
     exectest();
@@ -7,17 +7,19 @@
 #include "proc.h"
 #include "spinlock.h"
 #include "elf.h"
+#include "page.h"
+#include "fs.h"
+#include "file.h"
+#include "mman.h"
+#include "kmemstat.h"
 
 extern char data[];  // defined by kernel.ld
 pgd_t *kpgdir;       // for use in scheduler()
-uint64 llvaddr;      // used by debug
-
-// Xv6 can only allocate memory in 4KB blocks. This is fine
-// for x86. ARM's page table and page directory (for 28-bit
-// user address) have a size of 1KB. kpt_alloc/free is used
-// as a wrapper to support allocating page tables during boot
-// (use the initial kernel map, and during runtime, use buddy
-// memory allocator. 
+
+// Page tables (a granule each, see mmu.h) are allocated with
+// kpt_alloc/free, a wrapper to support allocating page tables
+// during boot (use the initial kernel map), and during runtime
+// (use pre-zeroed pages, see zpool.c).
 struct run {
     struct run *next;
 };
@@ -27,10 +29,40 @@ struct {
     struct run *freelist;
 } kpt_mem;
 
+static int tlb_has_range;   // FEAT_TLBIRANGE: TLBI RVALE1IS, see tlb_range
+static int hw_af;           // FEAT_HAFDBS: the MMU sets the access flag
+static int hw_dbm;          // and makes PTE_DBM pages dirty, see PTE_DBM
+
 void init_vmm (void)
 {
+    uint64 isar0, mmfr1, tcr;
+
     initlock(&kpt_mem.lock, "vm");
     kpt_mem.freelist = NULL;
+
+    // ID_AA64ISAR0_EL1.TLB is 2 with the TLB range instructions
+    asm("mrs %[v], ID_AA64ISAR0_EL1" : [v]"=r" (isar0) : :);
+    tlb_has_range = ((isar0 >> 56) & 0xf) >= 2;
+
+    // ID_AA64MMFR1_EL1.HAFDBS is 1 if the MMU can set the access flag,
+    // 2 if it can also update the dirty state. Without, the access flag
+    // fault and the permission fault on a clean page do it, see
+    // pagefault.
+    asm("mrs %[v], ID_AA64MMFR1_EL1" : [v]"=r" (mmfr1) : :);
+    hw_af = (mmfr1 & 0xf) >= 1;
+    hw_dbm = (mmfr1 & 0xf) >= 2;
+
+    if (hw_af) {
+        asm("MRS %[r], TCR_EL1": [r]"=r" (tcr): :);
+        tcr |= 1UL << TCR_EL1_HA;
+
+        if (hw_dbm) {
+            tcr |= 1UL << TCR_EL1_HD;
+        }
+
+        asm("MSR TCR_EL1, %[v]": :[v]"r" (tcr):);
+        asm("isb" : : :);
+    }
 }
 
 static void _kpt_free (char *v)
@@ -43,10 +75,10 @@ static void _kpt_free (char *v)
 }
 
 
-static void kpt_free (char *v)
+void kpt_free (char *v)
 {
     if (v >= (char*)P2V(INIT_KERNMAP)) {
-        kfree(v, PT_ORDER);
+        free_page(v);
         return;
     }
     
@@ -76,89 +108,55 @@ void* kpt_alloc (void)
 
     release(&kpt_mem.lock);
 
-    // Allocate a PT page if no inital pages is available
-    if ((r == NULL) && ((r = kmalloc (PT_ORDER)) == NULL)) {
-        panic("oom: kpt_alloc");
+    if (r != NULL) {
+        memset(r, 0, PT_SZ);
+        return (char*) r;
+    }
+
+    // Allocate a PT page if no inital pages is available. The
+    // allocator has already tried to reclaim memory if this fails.
+    if ((r = alloc_zeroed_page()) == NULL) {
+        return NULL;
     }
 
-    memset(r, 0, PT_SZ);
+    virt2page(r)->flags |= PG_PGTBL;
+
     return (char*) r;
 }
 
 // Return the address of the PTE in page directory that corresponds to
 // virtual address va.  If alloc!=0, create any required page table pages.
+// If va lies in a block (the kernel linear map, see paging_init, and
+// huge pages), the block descriptor is returned instead; it can be
+// told apart with ENTRY_IS_BLOCK.
 static pte_t* walkpgdir (pgd_t *pgdbase, const void *va, int alloc)
 {
-    pgd_t *pgd;
-    pmd_t *pmdbase;
-    pmd_t *pmd;
-    pte_t *ptebase;
-
-    pgd = &pgdbase[PGD_IDX((uint64)va)];
-
-    if(*pgd & (ENTRY_TABLE | ENTRY_VALID)) {
-        pmdbase = (pmd_t*) p2v((*pgd) & PG_ADDR_MASK);
-    } else {
-        if (!alloc || (pmdbase = (pmd_t*) kpt_alloc()) == 0) {
-            return 0;
-        }
-
-        memset(pmdbase, 0, PT_SZ);
-
-        *pgd = v2p(pmdbase) | ENTRY_TABLE | ENTRY_VALID;
-    }
-
-    pmd = &pmdbase[PMD_IDX(va)];
-
-    if (*pmd & (ENTRY_TABLE | ENTRY_VALID)) {
-        ptebase = (pte_t*) p2v((*pmd) & PG_ADDR_MASK);
-    } else {
-        if (!alloc || (ptebase = (pte_t*) kpt_alloc()) == 0) {
-           return 0;
-        }
-
-        // Make sure all those PTE_P bits are zero.
-        memset(ptebase, 0, PT_SZ);
+    pte_t *pte;
 
-        // The permissions here are overly generous, but they can
-        // be further restricted by the permissions in the page table
-        // entries, if necessary.
-        *pmd = v2p(ptebase) | ENTRY_TABLE | ENTRY_VALID;
+    if (pgtbl_walk(pgdbase, (uint64) va, 3, alloc, &pte) < 0) {
+        return 0;
     }
 
-    return &ptebase[PTE_IDX(va)];
+    return pte;
 }
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
 // be page-aligned.
-static int mappages (pgd_t *pgdir, void *va, uint size, uint pa, uint64 ap)
+static int mappages (pgd_t *pgdir, void *va, uint64 size, uint64 pa, uint64 ap)
 {
-    char *a, *last;
-    pte_t *pte;
+    uint64 a, end;
 
-    a = (char*) align_dn(va, PTE_SZ);
-    last = (char*) align_dn((uint64)va + size - 1, PTE_SZ);
+    a = align_dn(va, PTE_SZ);
+    end = align_up((uint64)va + size, PTE_SZ);
 
-    for (;;) {
-        if ((pte = walkpgdir(pgdir, a, 1)) == 0) {
-            return -1;
-        }
-
-        if (*pte & (ENTRY_PAGE | ENTRY_VALID)) {
-            panic("remap");
-        }
-
-        *pte = pa | ACCESS_FLAG | SH_IN_SH | ap | NON_SECURE_PA | MEM_ATTR_IDX_4 | ENTRY_PAGE | ENTRY_VALID;
-
-        if (a == last) {
-            break;
-        }
-
-        a += PTE_SZ;
-        pa += PTE_SZ;
+    // user (TTBR0) translations belong to one address space
+    if ((uint64) va < KERNBASE) {
+        ap |= NON_GLOBAL;
     }
-    return 0;
+
+    return pgtbl_map_pages(pgdir, a, end, align_dn(pa, PTE_SZ),
+                           ACCESS_FLAG | SH_IN_SH | ap | NON_SECURE_PA | MEM_ATTR_IDX_4);
 }
 
 // This function invalidates all translation entries at EL1 for this VMID
@@ -166,15 +164,69 @@ static int mappages (pgd_t *pgdir, void *va, uint size, uint pa, uint64 ap)
 // such as setting up MAIR, TCR, TTBR, you will need to use the synchronisation sequence
 // `dsb ish; isb` (provided by commit_tlb()) to ensure all writes are drained to memory, 
 // register writes are committed, and all PEs have the correct view of TLB.
+// It is only needed for the kernel map and on an ASID rollover; user
+// mappings are invalidated page by page, see tlb_batch.
 static void invalidate_tlb_el1(void)
 {
     asm("tlbi vmalle1" : : :);
 }
 
+// Address space identifiers. TCR_EL1.AS selects 16-bit ASIDs, which
+// tag the TLB entries of user pages (NON_GLOBAL), so switchuvm does not
+// have to flush the TLB. ASIDs are handed out in order and never freed;
+// when they run out, a new generation starts and the whole TLB is
+// flushed once. A process whose ASID is from an older generation gets
+// a new one the next time it is switched to. ASID 0 is never used for
+// a process. This assumes a single CPU, as does the rest of the kernel:
+// with more, the rollover must also flush the other CPUs and keep their
+// running ASIDs.
+#define ASID_BITS   16
+#define NASID       (1ULL << ASID_BITS)
+#define ASID(a)     ((a) & (NASID - 1))
+
+static uint64 asid_gen = NASID;     // in the bits above the ASID
+static uint64 asid_next = 1;
+
+// TTBR0 holds the boot map until the first process runs, with T0SZ for
+// its (kernel sized) layout. The first switch sets T0SZ for user space
+// and flushes the TLB, which also drops the global boot map entries.
+static int uva_ready;
+
+static void uva_init (void)
+{
+    uint64 tcr;
+
+    asm("MRS %[r], TCR_EL1": [r]"=r" (tcr): :);
+    tcr &= ~(0x3FUL << TCR_EL1_T0SZ);
+    tcr |= (64UL - UVA_BITS) << TCR_EL1_T0SZ;
+    asm("MSR TCR_EL1, %[v]": :[v]"r" (tcr):);
+
+    uva_ready = 1;
+}
+
+// give p an ASID of the current generation. Return 1 if a new
+// generation was started and the TLB must be flushed.
+static int asid_alloc (struct proc *p)
+{
+    int rollover;
+
+    rollover = 0;
+
+    if (asid_next == NASID) {
+        asid_gen += NASID;
+        asid_next = 1;
+        rollover = 1;
+    }
+
+    p->asid = asid_gen | asid_next++;
+    return rollover;
+}
+
 // Switch to the user page table (TTBR0)
 void switchuvm (struct proc *p)
 {
     uint64 val64;
+    int flush;
 
     pushcli();
 
@@ -182,66 +234,312 @@ void switchuvm (struct proc *p)
         panic("switchuvm: no pgdir");
     }
 
-    val64 = (uint64) V2P(p->pgdir) | 0x00;
+    flush = 0;
+
+    if ((p->asid & ~(NASID - 1)) != asid_gen) {
+        flush = asid_alloc(p);
+    }
+
+    if (!uva_ready) {
+        uva_init();
+        flush = 1;
+    }
+
+    val64 = (uint64) V2P(p->pgdir) | (ASID(p->asid) << 48);
 
     asm("MSR TTBR0_EL1, %[v]": :[v]"r" (val64):);
-    invalidate_tlb_el1();
+    asm("isb" : : :);
+
+    // on a rollover, flush after the switch: any entry speculatively
+    // loaded for the old TTBR0 carries an ASID that may be reused now
+    // (or, the first time, was made with the boot T0SZ)
+    if (flush) {
+        invalidate_tlb_el1();
+        asm("dsb ish; isb" : : :);
+    }
 
     popcli();
 }
 
-// Load the initcode into address 0 of pgdir. sz must be less than a page.
-void inituvm (pgd_t *pgdir, char *init, uint sz)
+// flush the TLB entries of p, which need not be the current process.
+// An ASID of an older generation has none left: its rollover flushed
+// them.
+static void tlb_flush_asid (struct proc *p)
 {
-    char *mem;
+    if ((p->asid & ~(NASID - 1)) == asid_gen) {
+        asm volatile("dsb ishst; tlbi aside1is, %[v]; dsb ish; isb"
+                     : :[v]"r" (ASID(p->asid) << 48) : "memory");
+    }
+}
 
-    if (sz >= PTE_SZ) {
-        panic("inituvm: more than a page");
+// TLB maintenance for user translations. An operation that unmaps
+// pages or takes away permissions starts a batch on the page table,
+// queues an invalidation per page or range, and ends the batch with
+// tlb_finish, which waits for all of them with one DSB/ISB. Pages that
+// were unmapped are given to tlb_free_page and only freed after that,
+// so no stale translation can reach them once they are reused. Only
+// the page table of the current process can have TLB entries that
+// matter: others are new, or belong to a process that will not run
+// again, and their ASID is not reused before a rollover flushes it.
+// Page tables that were unlinked (tlb_free_table) can also be in the
+// walk caches, which the last level TLBIs leave alone: a batch that
+// frees one flushes the whole ASID before it is done. So does one that
+// holds back more pages than it has room for, before the caller had a
+// chance to invalidate them.
+#define TLB_NFREE       32          // pages held back per batch
+#define TLB_MAX_PAGES   64          // larger ranges flush the whole ASID
+#define TLB_MAX_RANGE   (32 << 16)  // and ranges from this many pages up
+
+struct tlb_batch {
+    uint64  asid;                   // ASID << 48, for the TLBI operand
+    int     live;                   // the page table is the current one
+    int     pending;                // TLBIs not yet waited for
+    int     flush;                  // flush the whole ASID at tlb_finish
+    int     nfree;
+    void*   free[TLB_NFREE];
+    int     order[TLB_NFREE];       // of free[i], see alloc_pages; -1 for a page table
+};
+
+static void tlb_begin (struct tlb_batch *tb, pgd_t *pgdir)
+{
+    tb->live = (proc != 0) && (proc->pgdir == pgdir);
+    tb->asid = tb->live ? ASID(proc->asid) << 48 : 0;
+    tb->pending = 0;
+    tb->flush = 0;
+    tb->nfree = 0;
+}
+
+// the PTE updates must be visible to the table walker before any TLBI
+static void tlb_start (struct tlb_batch *tb)
+{
+    if (!tb->pending) {
+        asm volatile("dsb ishst" : : : "memory");
+        tb->pending = 1;
     }
+}
 
-    mem = alloc_page();
-    memset(mem, 0, PTE_SZ);
-    mappages(pgdir, 0, PTE_SZ, v2p(mem), AP_RW_1_0);
-    memmove(mem, init, sz);
+// wait for the invalidations, then free the pages held back
+static void tlb_finish (struct tlb_batch *tb)
+{
+    int i;
+
+    if (tb->flush) {
+        tlb_start(tb);
+        asm volatile("tlbi aside1is, %[v]" : :[v]"r" (tb->asid) : "memory");
+        tb->flush = 0;
+    }
+
+    if (tb->pending) {
+        asm volatile("dsb ish; isb" : : : "memory");
+        tb->pending = 0;
+    }
+
+    for (i = 0; i < tb->nfree; i++) {
+        if (tb->order[i] < 0) {
+            kpt_free(tb->free[i]);
+        } else {
+            free_pages(tb->free[i], tb->order[i]);
+        }
+    }
+
+    tb->nfree = 0;
 }
 
-// Load a program segment into pgdir.  addr must be page-aligned
-// and the pages from addr to addr+sz must already be mapped.
-int loaduvm (pgd_t *pgdir, char *addr, struct inode *ip, uint offset, uint sz)
+// invalidate the (last level) translation of one user page
+static void tlb_page (struct tlb_batch *tb, uint64 va)
 {
-    uint i, pa, n;
-    pte_t *pte;
+    if (tb->live) {
+        tlb_start(tb);
+        // the operand is VA[55:12] whatever the granule
+        asm volatile("tlbi vale1is, %[v]" : :[v]"r" (tb->asid | ((va >> 12) & 0xFFFFFFFFFFFULL)) : "memory");
+    }
+}
+
+// invalidate the translations of the user pages in [start, end)
+static void tlb_range (struct tlb_batch *tb, uint64 start, uint64 end)
+{
+    uint64 pages, n, op;
+    int scale, num;
 
-    if ((uint64) addr % PTE_SZ != 0) {
-        panic("loaduvm: addr must be page aligned");
+    if (!tb->live || (start >= end)) {
+        return;
+    }
+
+    start = align_dn(start, PTE_SZ);
+    pages = (align_up(end, PTE_SZ) - start) >> PTE_SHIFT;
+
+    if ((pages >= TLB_MAX_RANGE) || (!tlb_has_range && (pages > TLB_MAX_PAGES))) {
+        tlb_start(tb);
+        asm volatile("tlbi aside1is, %[v]" : :[v]"r" (tb->asid) : "memory");
+        return;
     }
 
-    for (i = 0; i < sz; i += PTE_SZ) {
-        if ((pte = walkpgdir(pgdir, addr + i, 0)) == 0) {
-            panic("loaduvm: address should exist");
+    if (!tlb_has_range) {
+        for (; pages > 0; pages--, start += PTE_SZ) {
+            tlb_page(tb, start);
         }
 
-        pa = PTE_ADDR(*pte);
+        return;
+    }
 
-        if (sz - i < PTE_SZ) {
-            n = sz - i;
-        } else {
-            n = PTE_SZ;
+    // A range operation covers (NUM+1) << (5*SCALE+1) pages: peel off
+    // an odd page, then chunks of increasing scale (as Linux does). Its
+    // TG field names the granule, and the base address is in pages.
+    // TLBI RVALE1IS is written as a SYS instruction, so the assembler
+    // does not have to know about ARMv8.4. SCALE is 2 bits: a range
+    // below TLB_MAX_RANGE is done by scale 3, and whatever is left past
+    // that flushes the whole ASID rather than spill into TG.
+    tlb_start(tb);
+
+    for (scale = 0; (pages > 0) && (scale <= 3); ) {
+        if (pages & 1) {
+            tlb_page(tb, start);
+            start += PTE_SZ;
+            pages--;
+            continue;
         }
 
-        if (readi(ip, p2v(pa), offset + i, n) != n) {
-            return -1;
+        num = ((pages >> (5 * scale + 1)) & 0x1f) - 1;
+
+        if (num >= 0) {
+            n = (uint64)(num + 1) << (5 * scale + 1);
+            op = tb->asid | ((uint64)TLBI_TG << 46) | ((uint64)scale << 44) | ((uint64)num << 39) |
+                 ((start >> PTE_SHIFT) & ((1ULL << 37) - 1));
+
+            asm volatile("sys #0, c8, c2, #5, %[v]" : :[v]"r" (op) : "memory");
+
+            start += n << PTE_SHIFT;
+            pages -= n;
         }
 
-	llvaddr = (uint64) p2v(pa);
+        scale++;
+    }
+
+    if (pages > 0) {
+        asm volatile("tlbi aside1is, %[v]" : :[v]"r" (tb->asid) : "memory");
+    }
+}
+
+// free the 2^order pages at v, which were mapped in the page table of
+// the batch, once their translations are gone
+static void tlb_free_pages (struct tlb_batch *tb, void *v, int order)
+{
+    if (!tb->live) {
+        free_pages(v, order);
+        return;
+    }
+
+    if (tb->nfree == TLB_NFREE) {
+        tb->flush = 1;
+        tlb_finish(tb);
+    }
+
+    tb->free[tb->nfree] = v;
+    tb->order[tb->nfree++] = order;
+}
+
+static void tlb_free_page (struct tlb_batch *tb, void *v)
+{
+    tlb_free_pages(tb, v, 0);
+}
+
+// free a page table that was unlinked from the page table of the batch
+static void tlb_free_table (struct tlb_batch *tb, pte_t *table)
+{
+    if (!tb->live) {
+        kpt_free((char*) table);
+        return;
     }
 
+    if (tb->nfree == TLB_NFREE) {
+        tb->flush = 1;
+        tlb_finish(tb);
+    }
+
+    tb->flush = 1;
+    tb->free[tb->nfree] = table;
+    tb->order[tb->nfree++] = -1;
+}
+
+// Transparent huge pages. A fault on untouched anonymous memory (the
+// heap, or an anonymous mmap) maps a whole level 2 block (2MB with 4KB
+// pages, 32MB with 16KB) at once if the aligned block around it lies
+// in that memory, nothing is mapped there yet and the buddy allocator
+// has a free block: one TLB entry and no last level table then cover
+// it. The 512MB blocks of 64KB pages are too large for the allocator
+// (see MAX_PAGE_ORDER), so there are none. A block is only ever mapped
+// by one process. It is split into pages (split_huge) when that is no
+// longer enough: before fork shares it copy-on-write, and when munmap,
+// sbrk or mprotect cover part of it.
+static struct {
+    uint64  mapped;             // blocks mapped now
+    uint64  allocs;
+    uint64  splits;
+    uint64  fallbacks;          // no free block, mapped a page instead
+} thp;
+
+// Map the block at va in pgdir as pages, with the same memory and
+// permissions. Returns -1 if memory for the page table is short.
+static int split_huge (pgd_t *pgdir, uint64 va)
+{
+    struct tlb_batch tb;
+    pmd_t *pmd;
+    pte_t *ptebase;
+    uint64 pa, attr;
+    int i;
+
+    va = align_dn(va, PMD_SZ);
+
+    if ((pgtbl_walk(pgdir, va, 2, 0, &pmd) != 2) || !ENTRY_IS_BLOCK(*pmd)) {
+        return 0;
+    }
+
+    if ((ptebase = kpt_alloc()) == 0) {
+        return -1;
+    }
+
+    pa = PTE_ADDR(*pmd);
+    attr = *pmd & ~(PG_ADDR_MASK | ENTRY_MASK);
+
+    for (i = 0; i < PTRS_PER_PTE; i++) {
+        ptebase[i] = (pa + ((uint64)i << PTE_SHIFT)) | attr | ENTRY_PAGE | ENTRY_VALID;
+    }
+
+    split_pages(p2v(pa), PMD_ORDER);
+
+    // break before make. The block is one TLB entry: one TLBI for any
+    // address in it removes it.
+    tlb_begin(&tb, pgdir);
+    *pmd = 0;
+    tlb_page(&tb, va);
+    tlb_finish(&tb);
+
+    *pmd = v2p(ptebase) | ENTRY_TABLE | ENTRY_VALID;
+    asm volatile("dsb ishst" : : : "memory");
+
+    thp.mapped--;
+    thp.splits++;
+
     return 0;
 }
 
+// Load the initcode into address 0 of pgdir. sz must be less than a page.
+void inituvm (pgd_t *pgdir, char *init, uint sz)
+{
+    char *mem;
+
+    if (sz >= PTE_SZ) {
+        panic("inituvm: more than a page");
+    }
+
+    mem = alloc_zeroed_page();
+    mappages(pgdir, 0, PTE_SZ, v2p(mem), AP_RW_1_0);
+    memmove(mem, init, sz);
+}
+
 // Allocate page tables and physical memory to grow process from oldsz to
 // newsz, which need not be page aligned.  Returns new size or 0 on error.
-int allocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
+uint64 allocuvm (pgd_t *pgdir, uint64 oldsz, uint64 newsz)
 {
     char *mem;
     uint64 a;
@@ -257,7 +555,7 @@ int allocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
     a = align_up(oldsz, PTE_SZ);
 
     for (; a < newsz; a += PTE_SZ) {
-        mem = alloc_page();
+        mem = alloc_zeroed_page();
 
         if (mem == 0) {
             cprintf("allocuvm out of memory\n");
@@ -265,46 +563,88 @@ int allocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
             return 0;
         }
 
-        memset(mem, 0, PTE_SZ);
-        mappages(pgdir, (char*) a, PTE_SZ, v2p(mem), AP_RW_1_0);
+        // a page table may be needed, which can fail now as well
+        if (mappages(pgdir, (char*) a, PTE_SZ, v2p(mem), AP_RW_1_0) < 0) {
+            cprintf("allocuvm out of memory\n");
+            free_page(mem);
+            deallocuvm(pgdir, newsz, oldsz);
+            return 0;
+        }
     }
 
     return newsz;
 }
 
+// A deallocuvm in progress: the pages of [start, end) go
+struct dealloc {
+    pgd_t*              pgdir;
+    uint64              start;
+    uint64              end;
+    struct tlb_batch    tb;
+};
+
+static int dealloc_leaf (pte_t *pte, int level, uint64 va, void *arg)
+{
+    struct dealloc *d;
+    uint64 pa;
+
+    d = arg;
+    pa = PTE_ADDR(*pte);
+
+    if (level == 3) {
+        if (pa == 0) {
+            panic("deallocuvm");
+        }
+
+        *pte = 0;
+        tlb_free_page(&d->tb, p2v(pa));
+        return 0;
+    }
+
+    // a block goes whole, or is split to free a part of it (the walk
+    // then goes on into the new table). If that cannot be done, it
+    // stays until the process exits.
+    if ((va >= d->start) && (va + PMD_SZ <= d->end)) {
+        *pte = 0;
+        tlb_free_pages(&d->tb, p2v(pa), PMD_ORDER);
+        thp.mapped--;
+
+    } else {
+        split_huge(d->pgdir, va);
+    }
+
+    return 0;
+}
+
+static void dealloc_table (pte_t *table, void *arg)
+{
+    struct dealloc *d;
+
+    d = arg;
+    tlb_free_table(&d->tb, table);
+}
+
 // Deallocate user pages to bring the process size from oldsz to
 // newsz.  oldsz and newsz need not be page-aligned, nor does newsz
 // need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
-int deallocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
+// process size.  Returns the new process size. Only the tables that
+// are there are walked, and those left empty are freed.
+uint64 deallocuvm (pgd_t *pgdir, uint64 oldsz, uint64 newsz)
 {
-    pte_t *pte;
-    uint64 a;
-    uint pa;
+    struct dealloc d;
 
     if (newsz >= oldsz) {
         return oldsz;
     }
 
-    for (a = align_up(newsz, PTE_SZ); a < oldsz; a += PTE_SZ) {
-        pte = walkpgdir(pgdir, (char*) a, 0);
+    d.pgdir = pgdir;
+    d.start = align_up(newsz, PTE_SZ);
+    d.end = oldsz;
 
-        if (!pte) {
-            // pte == 0 --> no page table for this entry
-            // round it up to the next page directory
-            a = align_up (a, PMD_SZ);
-
-        } else if ((*pte & (ENTRY_PAGE | ENTRY_VALID)) != 0) {
-            pa = PTE_ADDR(*pte);
-
-            if (pa == 0) {
-                panic("deallocuvm");
-            }
-
-            free_page(p2v(pa));
-            *pte = 0;
-        }
-    }
+    tlb_begin(&d.tb, pgdir);
+    pgtbl_range(pgdir, d.start, d.end, dealloc_leaf, dealloc_table, &d);
+    tlb_range(&d.tb, d.start, d.end);
+    tlb_finish(&d.tb);
 
     return newsz;
 }
@@ -313,39 +653,23 @@ int deallocuvm (pgd_t *pgdir, uint oldsz, uint newsz)
 // in the user part.
 void freevm (pgd_t *pgdir)
 {
-    uint i,j;
-    char *v;
-    pmd_t *pmdbase;
-
     if (pgdir == 0) {
         panic("freevm: no pgdir");
     }
 
-    // release the user space memroy, but not page tables
+    // release the user space memory, and the tables below the root
+    // with it
     deallocuvm(pgdir, UADDR_SZ, 0);
 
-    // release the page tables
-    for(j = 0; j < PTRS_PER_PGD; j++) {
-        if(pgdir[j] & (ENTRY_TABLE | ENTRY_VALID)) {
-            pmdbase = (pmd_t*) p2v(pgdir[j] & PG_ADDR_MASK);
-
-            for (i = 0; i < PTRS_PER_PMD; i++) {
-                if (pmdbase[i] & (ENTRY_TABLE | ENTRY_VALID)) {
-                    v = p2v(PT_ADDR(pmdbase[i]));
-                    kpt_free(v);
-                }
-            }
-            kpt_free((char*) pmdbase);
-        }
-    }
-
-    kpt_free((char*) pgdir);
+    // release what is left: the root
+    pgtbl_free(pgdir);
 }
 
 // Clear PTE_U on a page. Used to create an inaccessible page beneath
 // the user stack (to trap stack underflow).
 void clearpteu (pgd_t *pgdir, char *uva)
 {
+    struct tlb_batch tb;
     pte_t *pte;
 
     pte = walkpgdir(pgdir, uva, 0);
@@ -355,52 +679,633 @@ void clearpteu (pgd_t *pgdir, char *uva)
 
     // in ARM, we change the AP field (ap & 0x3) << 4)
     *pte = (*pte & ~(0x03 << 6)) | AP_RW_1;
+
+    tlb_begin(&tb, pgdir);
+    tlb_page(&tb, (uint64) uva);
+    tlb_finish(&tb);
 }
 
-// Given a parent process's page table, create a copy
-// of it for a child.
-pgd_t* copyuvm (pgd_t *pgdir, uint sz)
+// Copy the pages of [start, end) from the page table s to d, or map
+// them in both if share is set (shared mappings). Set *cow if pages
+// were made copy-on-write. Returns -1 if memory is short.
+static int copyrange (pgd_t *s, pgd_t *d, uint64 start, uint64 end, int share, int *cow)
 {
-    pgd_t *d;
     pte_t *pte;
     uint64 pa, i, ap;
     char *mem;
 
-    // allocate a new first level page directory
-    d = kpt_alloc();
-    if (d == NULL ) {
-        return NULL ;
-    }
+    // share the user pages copy-on-write: both sides map them read-only
+    // and the first write (see cowfault) gets the writer its own copy.
+    // Read-only pages of the program are simply shared, and pages that
+    // user code cannot access (the stack guard) are copied.
+    for (i = start; i < end; i += PTE_SZ) {
+        // pages are only there once touched, see pagefault
+        if ((pte = walkpgdir(s, (void *) i, 0)) == 0) {
+            i = pgtbl_next(s, i) - PTE_SZ;
+            continue;
+        }
 
-    // copy the whole address space over (no COW)
-    for (i = 0; i < sz; i += PTE_SZ) {
-        if ((pte = walkpgdir(pgdir, (void *) i, 0)) == 0) {
-            panic("copyuvm: pte should exist");
+        // only one process maps a block: share its pages instead
+        if (ENTRY_IS_BLOCK(*pte) &&
+            ((split_huge(s, i) < 0) || ((pte = walkpgdir(s, (void *) i, 0)) == 0))) {
+            return -1;
         }
 
         if (!(*pte & (ENTRY_PAGE | ENTRY_VALID))) {
-            panic("copyuvm: page not present");
+            continue;
         }
 
         pa = PTE_ADDR (*pte);
-        ap = PTE_AP (*pte);
+        ap = *pte & (AP_MASK | PTE_COW | PTE_DBM | UXN);
+
+        if (!share && ((PTE_AP(ap) == AP_RW_1_0) || (ap & PTE_COW))) {
+            *pte = (*pte & ~AP_MASK) | AP_RO_1_0 | PTE_COW;
+            ap = (ap & ~AP_MASK) | AP_RO_1_0 | PTE_COW;
+            *cow = 1;
+        }
+
+        // read-only program pages are shared as they are
+        if (share || (PTE_AP(ap) == AP_RO_1_0)) {
+            if (mappages(d, (void*) i, PTE_SZ, pa, ap) < 0) {
+                return -1;
+            }
+
+            get_page(p2v(pa));
+            continue;
+        }
 
         if ((mem = alloc_page()) == 0) {
-            goto bad;
+            return -1;
         }
 
         memmove(mem, (char*) p2v(pa), PTE_SZ);
 
         if (mappages(d, (void*) i, PTE_SZ, v2p(mem), ap) < 0) {
-            goto bad;
+            free_page(mem);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Given a parent process, create a copy of its page table for a child:
+// the program, stack and heap below p->sz, and its mmap regions.
+pgd_t* copyuvm (struct proc *p)
+{
+    struct tlb_batch tb;
+    struct vma *v;
+    pgd_t *d;
+    int cow, r;
+
+    cow = 0;
+
+    // allocate a new first level page directory
+    d = kpt_alloc();
+    if (d == NULL ) {
+        return NULL ;
+    }
+
+    r = copyrange(p->pgdir, d, 0, p->sz, 0, &cow);
+
+    for (v = p->vmas; (v != 0) && (r == 0); v = v->next) {
+        if (v->start >= p->sz) {
+            r = copyrange(p->pgdir, d, v->start, v->end, v->flags & MAP_SHARED, &cow);
         }
     }
+
+    // the parent may have writable translations cached
+    if (cow) {
+        tlb_begin(&tb, p->pgdir);
+        tlb_range(&tb, 0, UADDR_SZ);
+        tlb_finish(&tb);
+    }
+
+    if (r < 0) {
+        freevm(d);
+        return 0;
+    }
+
     return d;
+}
+
+// Resolve a write fault on a copy-on-write page: copy the page unless
+// this is the last reference to it, and map it writable. Returns -1 if
+// va is not a copy-on-write page or memory is short.
+int cowfault (pgd_t *pgdir, uint64 va)
+{
+    struct tlb_batch tb;
+    pte_t *pte, old;
+    uint64 pa;
+    char *mem;
+
+    if (((pte = walkpgdir(pgdir, (void*) va, 0)) == 0) || !(*pte & PTE_COW)) {
+        return -1;
+    }
+
+    old = *pte;
+    pa = PTE_ADDR(old);
+    tlb_begin(&tb, pgdir);
+
+    if (page_count(p2v(pa)) > 1) {
+        if ((mem = alloc_page()) == 0) {
+            return -1;
+        }
+
+        memmove(mem, p2v(pa), PTE_SZ);
+
+        // break before make: the translation to the shared page must be
+        // gone before one to the copy appears
+        *pte = 0;
+        tlb_page(&tb, va);
+        tlb_finish(&tb);
+
+        *pte = (old & ~(PG_ADDR_MASK | AP_MASK | PTE_COW)) | v2p(mem) | AP_RW_1_0;
+        asm volatile("dsb ishst" : : : "memory");
+
+        free_page(p2v(pa));
+        return 0;
+    }
+
+    *pte = (*pte & ~(AP_MASK | PTE_COW)) | AP_RW_1_0;
+    tlb_page(&tb, va);
+    tlb_finish(&tb);
+
+    return 0;
+}
+
+// Map a zeroed page at va with permissions ap, part of the heap that
+// sbrk has reserved (see growproc) or of an anonymous region, that
+// nothing has touched yet. Returns -1 if a page is already mapped there
+// or memory is short.
+static int zerofault (pgd_t *pgdir, uint64 va, uint64 ap)
+{
+    pte_t *pte;
+    char *mem;
+
+    va = align_dn(va, PTE_SZ);
+
+    if (((pte = walkpgdir(pgdir, (void*) va, 0)) != 0) && (*pte & ENTRY_VALID)) {
+        return -1;
+    }
+
+    if ((mem = alloc_zeroed_page()) == 0) {
+        return -1;
+    }
+
+    if (mappages(pgdir, (void*) va, PTE_SZ, v2p(mem), ap) < 0) {
+        free_page(mem);
+        return -1;
+    }
+
+    // the new entry must be visible to the table walk that retries
+    asm volatile("dsb ishst" : : : "memory");
+
+    return 0;
+}
+
+// Map a zeroed block around va, in anonymous memory of p (region
+// v, or the heap if v is 0) that nothing has touched, with permissions
+// ap. Returns -1 if no block fits there; the caller maps a page then.
+static int hugefault (struct proc *p, struct vma *v, uint64 va, uint64 ap)
+{
+    struct vma *o;
+    pmd_t *pmd;
+    uint64 start, end;
+    char *mem;
+
+    if (PMD_ORDER > MAX_PAGE_ORDER) {
+        return -1;
+    }
+
+    start = align_dn(va, PMD_SZ);
+    end = start + PMD_SZ;
+
+    if (v != 0) {
+        if ((start < v->start) || (end > v->end)) {
+            return -1;
+        }
+
+    } else {
+        if (end > p->sz) {
+            return -1;
+        }
+
+        // the program segments lie below sz, too
+        for (o = p->vmas; o != 0; o = o->next) {
+            if ((o->start < end) && (o->end > start)) {
+                return -1;
+            }
+        }
+    }
+
+    if ((pgtbl_walk(p->pgdir, start, 2, 1, &pmd) != 2) || (*pmd & ENTRY_VALID)) {
+        return -1;
+    }
+
+    if ((mem = alloc_pages(PMD_ORDER)) == 0) {
+        thp.fallbacks++;
+        return -1;
+    }
+
+    memset(mem, 0, PMD_SZ);
+
+    *pmd = v2p(mem) | ACCESS_FLAG | SH_IN_SH | ap | NON_GLOBAL | NON_SECURE_PA | MEM_ATTR_IDX_4 |
+           ENTRY_BLOCK | ENTRY_VALID;
+    asm volatile("dsb ishst" : : : "memory");
+
+    thp.mapped++;
+    thp.allocs++;
+
+    return 0;
+}
+
+// the permissions of the pages of v. PROT_NONE pages are left to
+// the kernel, as is the stack guard. Writable pages of a shared file
+// mapping start clean, so that syncuvm can tell which were written.
+static uint64 vma_ap (struct vma *v)
+{
+    uint64 ap;
+
+    if ((v->prot & PROT_WRITE) && v->ip && (v->flags & MAP_SHARED)) {
+        ap = AP_RO_1_0 | PTE_DBM;
+    } else if (v->prot & PROT_WRITE) {
+        ap = AP_RW_1_0;
+    } else if (v->prot & (PROT_READ | PROT_EXEC)) {
+        ap = AP_RO_1_0;
+    } else {
+        ap = AP_RW_1;
+    }
+
+    if (!(v->prot & PROT_EXEC)) {
+        ap |= UXN;
+    }
+
+    return ap;
+}
+
+// Fill in the page at va of process p, in its region v: from the file
+// for the part of the page that v reads from it, with zeroes for the
+// rest. Pages that the file fills entirely are shared through pcache.c
+// where that is safe: read-only private mappings (the program text) map
+// them read-only, shared mappings map them as they are. Returns -1 if
+// memory is short or the file cannot be read. Reading may sleep, so
+// this fails for file pages when spinlocks are held; system calls touch
+// their user buffers early (argptr) so that this does not happen.
+static int pagein (struct proc *p, struct vma *v, uint64 va)
+{
+    char *mem;
+    uint64 lo, hi, off;
+    int n, whole, cache;
+
+    if (cpu->ncli > 0) {
+        return -1;
+    }
+
+    // bytes [lo, hi) of the page come from the file, at off
+    lo = (va > v->fstart) ? va : v->fstart;
+    hi = (va + PTE_SZ < v->fend) ? va + PTE_SZ : v->fend;
+    off = v->off + (lo - v->fstart);
+    whole = (lo == va) && (hi == va + PTE_SZ);
+    cache = whole && ((v->flags & MAP_SHARED) || !(v->prot & PROT_WRITE));
+
+    mem = cache ? pcache_get(v->ip, off) : 0;
+
+    if (mem == 0) {
+        if ((mem = whole ? alloc_page() : alloc_zeroed_page()) == 0) {
+            return -1;
+        }
+
+        n = 0;
+
+        if (lo < hi) {
+            ilock(v->ip);
+            n = readi(v->ip, mem + (lo - va), off, hi - lo);
+            iunlock(v->ip);
+        }
+
+        // past the end of the file (an mmap may be larger) are zeroes
+        if (n < 0) {
+            n = 0;
+        }
+
+        if (n < hi - lo) {
+            memset(mem + (lo - va) + n, 0, hi - lo - n);
+            cache = 0;
+        }
+
+        if (cache) {
+            pcache_add(v->ip, off, mem);
+        }
+    }
+
+    if (mappages(p->pgdir, (void*) va, PTE_SZ, v2p(mem), vma_ap(v)) < 0) {
+        free_page(mem);
+        return -1;
+    }
+
+    asm volatile("dsb ishst" : : : "memory");
+
+    return 0;
+}
+
+// Map the page at va of the shared memory segment of region v, which
+// every process that maps the segment gets the same of.
+static int shmfault (struct proc *p, struct vma *v, uint64 va)
+{
+    char *mem;
+
+    if ((mem = shm_page(v->shm, v->off + (va - v->fstart))) == 0) {
+        return -1;
+    }
+
+    if (mappages(p->pgdir, (void*) va, PTE_SZ, v2p(mem), vma_ap(v)) < 0) {
+        free_page(mem);
+        return -1;
+    }
+
+    asm volatile("dsb ishst" : : : "memory");
+
+    return 0;
+}
+
+// Resolve a fault of process p on va, a write if write is set: bring
+// in the page of the heap or of a region that has not been touched yet,
+// copy a copy-on-write page, or do what the MMU does with FEAT_HAFDBS:
+// set the access flag, or make a clean page dirty. Returns -1 if p may
+// not access va that way or memory is short.
+int pagefault (struct proc *p, uint64 va, int write)
+{
+    struct tlb_batch tb;
+    struct vma *v;
+    pte_t *pte;
+    uint64 ap;
+
+    va = align_dn(va, PTE_SZ);
+
+    if ((v = vma_find(p->vmas, va)) != 0) {
+        if (!(v->prot & (write ? PROT_WRITE : (PROT_READ | PROT_WRITE | PROT_EXEC)))) {
+            return -1;
+        }
+
+    } else if (va >= p->sz) {
+        return -1;
+    }
+
+    pte = walkpgdir(p->pgdir, (void*) va, 0);
+
+    if ((pte == 0) || !(*pte & ENTRY_VALID)) {
+        if (v && v->ip) {
+            return pagein(p, v, va);
+        }
+
+        if (v && v->shm) {
+            return shmfault(p, v, va);
+        }
+
+        // anonymous memory: the heap, or an (always private) mmap
+        ap = v ? vma_ap(v) : AP_RW_1_0;
+
+        if (hugefault(p, v, va, ap) == 0) {
+            return 0;
+        }
+
+        return zerofault(p->pgdir, va, ap);
+    }
+
+    // the stack guard
+    if (PTE_AP(*pte) == AP_RW_1) {
+        return -1;
+    }
+
+    // a page that was not referenced since ageuvm last looked at it. A
+    // fault-causing entry is not in the TLB, so no invalidation.
+    if (!(*pte & ACCESS_FLAG)) {
+        *pte |= ACCESS_FLAG;
+        asm volatile("dsb ishst" : : : "memory");
+
+        if (!write || (PTE_AP(*pte) == AP_RW_1_0)) {
+            return 0;
+        }
+    }
+
+    // the first write to a clean page. The read-only translation may
+    // be in the TLB.
+    if (write && (*pte & PTE_DBM) && (PTE_AP(*pte) == AP_RO_1_0)) {
+        *pte = (*pte & ~AP_MASK) | AP_RW_1_0;
+
+        tlb_begin(&tb, p->pgdir);
+        tlb_page(&tb, va);
+        tlb_finish(&tb);
+
+        return 0;
+    }
+
+    if (write && (PTE_AP(*pte) != AP_RW_1_0)) {
+        return cowfault(p->pgdir, va);
+    }
 
-bad: freevm(d);
     return 0;
 }
 
+// Get the page at va of process p in, writable, for the kernel to write
+// to in place: as pagefault does on a write by the process, but without
+// writing to it (a read and write back could lose a store by another
+// process that shares the page). Returns -1 if p may not write va.
+int writeuvm (struct proc *p, uint64 va)
+{
+    pte_t *pte;
+
+    pte = walkpgdir(p->pgdir, (void*) va, 0);
+
+    if ((pte != 0) && (*pte & ENTRY_VALID) && (PTE_AP(*pte) == AP_RW_1_0)) {
+        return 0;
+    }
+
+    return pagefault(p, va, 1);
+}
+
+// Apply v->prot to the pages of v that are in, after mprotect. Private
+// pages that are shared with others stay copy-on-write. Pages of a
+// shared file mapping stay clean only if they were: one that loses
+// PROT_WRITE no longer tells, and syncuvm writes it back. Returns -1
+// if a block that v covers only in part cannot be split.
+int protuvm (pgd_t *pgdir, struct vma *v)
+{
+    struct tlb_batch tb;
+    pte_t *pte;
+    uint64 a, ap;
+
+    tlb_begin(&tb, pgdir);
+
+    for (a = v->start; a < v->end; a += PTE_SZ) {
+        if ((pte = walkpgdir(pgdir, (void*) a, 0)) == 0) {
+            a = pgtbl_next(pgdir, a) - PTE_SZ;
+            continue;
+        }
+
+        if (!(*pte & ENTRY_VALID)) {
+            continue;
+        }
+
+        // anonymous blocks are private to the process
+        if (ENTRY_IS_BLOCK(*pte) && (align_dn(a, PMD_SZ) == a) && (a + PMD_SZ <= v->end)) {
+            *pte = (*pte & ~(AP_MASK | UXN | PTE_COW)) | vma_ap(v);
+            a += PMD_SZ - PTE_SZ;
+            continue;
+        }
+
+        if (ENTRY_IS_BLOCK(*pte) &&
+            ((split_huge(pgdir, a) < 0) || ((pte = walkpgdir(pgdir, (void*) a, 0)) == 0))) {
+            tlb_range(&tb, v->start, v->end);
+            tlb_finish(&tb);
+            return -1;
+        }
+
+        ap = vma_ap(v);
+
+        if ((PTE_AP(ap) == AP_RW_1_0) && (v->flags & MAP_PRIVATE) &&
+            ((*pte & PTE_COW) || (page_count(p2v(PTE_ADDR(*pte))) > 1))) {
+            ap = (ap & ~AP_MASK) | AP_RO_1_0 | PTE_COW;
+        }
+
+        if ((ap & PTE_DBM) && !((*pte & PTE_DBM) && (PTE_AP(*pte) == AP_RO_1_0))) {
+            ap = (ap & ~AP_MASK) | AP_RW_1_0;
+        }
+
+        *pte = (*pte & ~(AP_MASK | UXN | PTE_COW | PTE_DBM)) | ap;
+    }
+
+    tlb_range(&tb, v->start, v->end);
+    tlb_finish(&tb);
+
+    return 0;
+}
+
+// Write the pages of v that are in back to its file, if v is a shared
+// file mapping that could be written. Pages that are still clean (see
+// vma_ap) are skipped. Only the part of the file that v maps and that
+// exists is written: a mapping does not grow its file.
+void syncuvm (pgd_t *pgdir, struct vma *v)
+{
+    pte_t *pte;
+    uint64 a, lo, hi, off, n, max;
+    char *mem;
+
+    if (!(v->flags & MAP_SHARED) || (v->ip == 0) || !(v->maxprot & PROT_WRITE)) {
+        return;
+    }
+
+    // as filewrite, in pieces that fit in the log
+    max = ((LOGSIZE - 1 - 1 - 2) / 2) * 512;
+
+    for (a = v->start; a < v->end; a += PTE_SZ) {
+        if ((pte = walkpgdir(pgdir, (void*) a, 0)) == 0) {
+            a = pgtbl_next(pgdir, a) - PTE_SZ;
+            continue;
+        }
+
+        if (!(*pte & ENTRY_VALID) || ((*pte & PTE_DBM) && (PTE_AP(*pte) == AP_RO_1_0))) {
+            continue;
+        }
+
+        mem = p2v(PTE_ADDR(*pte));
+        lo = (a > v->fstart) ? a : v->fstart;
+        hi = (a + PTE_SZ < v->fend) ? a + PTE_SZ : v->fend;
+
+        for (; lo < hi; lo += n) {
+            off = v->off + (lo - v->fstart);
+            n = (hi - lo < max) ? hi - lo : max;
+
+            begin_trans();
+            ilock(v->ip);
+
+            if (off + n > v->ip->size) {
+                n = (off < v->ip->size) ? v->ip->size - off : 0;
+            }
+
+            if (n > 0) {
+                writei(v->ip, mem + (lo - a), off, n);
+            }
+
+            iunlock(v->ip);
+            commit_trans();
+
+            if (n == 0) {
+                break;
+            }
+        }
+    }
+}
+
+// Page aging. The scheduler calls ageuvm for each process every
+// AGE_TICKS. A page is referenced if its access flag was set since the
+// last scan, by the MMU (TCR_EL1.HA) or by pagefault on the access
+// flag fault. The scan clears the flag again, and keeps the number of
+// scans since the page was last referenced in its PTE_AGE bits, up to
+// AGE_MAX: reclaim, or a swap or writeback path, can go for the oldest
+// pages first. The pages referenced within the last AGE_WSS scans are
+// the working set of the process.
+#define AGE_MAX     3
+#define AGE_WSS     2
+
+struct aging {
+    uint64  rss;                    // pages mapped
+    uint64  wss;                    // pages in the working set
+    int     cleared;                // access flags were cleared
+};
+
+static int age_leaf (pte_t *pte, int level, uint64 va, void *arg)
+{
+    struct aging *a;
+    uint64 age, n;
+
+    a = arg;
+    n = (level == 3) ? 1 : (1ULL << PMD_ORDER);
+    age = (*pte & PTE_AGE) >> PTE_AGE_SHIFT;
+
+    if (*pte & ACCESS_FLAG) {
+        age = 0;
+        a->cleared = 1;
+    } else if (age < AGE_MAX) {
+        age++;
+    }
+
+    *pte = (*pte & ~(PTE_AGE | ACCESS_FLAG)) | (age << PTE_AGE_SHIFT);
+
+    a->rss += n;
+
+    if (age < AGE_WSS) {
+        a->wss += n;
+    }
+
+    return 0;
+}
+
+// Age the pages of p and update p->rss and p->wss. p must not be in
+// the middle of changing its page table: the scheduler calls this with
+// ptable.lock held, and a process only gives up the CPU where it does
+// not hold on to a page table entry that this changes.
+void ageuvm (struct proc *p)
+{
+    struct aging a;
+
+    a.rss = 0;
+    a.wss = 0;
+    a.cleared = 0;
+
+    pgtbl_range(p->pgdir, 0, UADDR_SZ, age_leaf, 0, &a);
+
+    // translations cached with the access flag set would not fault
+    // (nor be written back by the MMU) on the next reference
+    if (a.cleared) {
+        tlb_flush_asid(p);
+    }
+
+    p->rss = a.rss;
+    p->wss = a.wss;
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char* uva2ka (pgd_t *pgdir, char *uva)
@@ -410,7 +1315,7 @@ char* uva2ka (pgd_t *pgdir, char *uva)
     pte = walkpgdir(pgdir, uva, 0);
 
     // make sure it exists
-    if ((*pte & (ENTRY_PAGE | ENTRY_VALID)) == 0) {
+    if ((pte == 0) || (*pte & (ENTRY_PAGE | ENTRY_VALID)) == 0) {
         return 0;
     }
 
@@ -419,13 +1324,19 @@ char* uva2ka (pgd_t *pgdir, char *uva)
         return 0;
     }
 
+    // the page within a block
+    if (ENTRY_IS_BLOCK(*pte)) {
+        return (char*) p2v(PTE_ADDR(*pte)) + ((uint64) uva & (PMD_SZ - PTE_SZ));
+    }
+
     return (char*) p2v(PTE_ADDR(*pte));
 }
 
 // Copy len bytes from p to user address va in page table pgdir.
-// Most useful when pgdir is not the current page table.
+// Most useful when pgdir is not the current page table (exec): the
+// current one is reached directly, see copy_to_user.
 // uva2ka ensures this only works for user pages.
-int copyout (pgd_t *pgdir, uint va, void *p, uint len)
+int copyout (pgd_t *pgdir, uint64 va, void *p, uint64 len)
 {
     char *buf, *pa0;
     uint64 n, va0;
@@ -436,6 +1347,17 @@ int copyout (pgd_t *pgdir, uint va, void *p, uint len)
         va0 = align_dn(va, PTE_SZ);
         pa0 = uva2ka(pgdir, (char*) va0);
 
+        // a shared copy-on-write page is read-only until copied
+        if ((pa0 == 0) && (cowfault(pgdir, va0) == 0)) {
+            pa0 = uva2ka(pgdir, (char*) va0);
+        }
+
+        // and the current process gets its pages on first use
+        if ((pa0 == 0) && (proc != 0) && (pgdir == proc->pgdir) &&
+            (pagefault(proc, va0, 1) == 0)) {
+            pa0 = uva2ka(pgdir, (char*) va0);
+        }
+
         if (pa0 == 0) {
             return -1;
         }
@@ -457,14 +1379,76 @@ int copyout (pgd_t *pgdir, uint va, void *p, uint len)
 }
 
 
-// 1:1 map the memory [phy_low, phy_hi] in kernel. We need to
-// use 2-level mapping for this block of memory. The rumor has
-// it that ARMv6's small brain cannot handle the case that memory
-// be mapped in both 1-level page table and 2-level page. For
-// initial kernel, we use 1MB mapping, other memory needs to be
-// mapped as 4KB pages
+// the transparent huge page counters, for the kmemstat system call
+void thp_stat (struct kmemstat *st)
+{
+    st->thp_mapped = thp.mapped;
+    st->thp_allocs = thp.allocs;
+    st->thp_splits = thp.splits;
+    st->thp_fallbacks = thp.fallbacks;
+}
+
+void thp_dump (void)
+{
+    cprintf("thp: %d mapped, %d allocs, %d splits, %d fallbacks\n", (uint)thp.mapped,
+            (uint)thp.allocs, (uint)thp.splits, (uint)thp.fallbacks);
+}
+
+// 1:1 map the memory [phy_low, phy_hi) in kernel, with the largest
+// descriptors that alignment allows: blocks of the highest level that
+// has them (1GB with 4KB pages) where nothing else is mapped in yet,
+// level 2 blocks, and pages only at unaligned edges. Memory the boot
+// map (set_bootpgtbl) covers already is left as it is. The few page
+// tables this takes come from the pool set aside at boot
+// (kpt_freerange), as the buddy allocator is not up yet. The
+// attributes are those of the boot map.
 void paging_init (uint64 phy_low, uint64 phy_hi)
 {
-    mappages (P2V(&_kernel_pgtbl), P2V(phy_low), phy_hi - phy_low, phy_low, AP_RW_1_0);
+    pgd_t *kpgd;
+    pte_t *e;
+    uint64 pa, sz, attr;
+    int lvl, got;
+
+    kpgd = P2V(&_kernel_pgtbl);
+    attr = ACCESS_FLAG | SH_IN_SH | AP_RW_1 | NON_SECURE_PA | MEM_ATTR_IDX_4 | UXN;
+
+    for (pa = phy_low; pa < phy_hi; pa = align_dn(pa, sz) + sz) {
+        for (lvl = PT_BLOCK_LEVEL; ; lvl++) {
+            sz = 1ULL << PT_LEVEL_SHIFT(lvl);
+
+            if ((got = pgtbl_walk(kpgd, (uint64) P2V(pa), lvl, 1, &e)) < 0) {
+                panic("paging_init: out of boot page tables");
+            }
+
+            // mapped by a block or page of the boot map
+            if (ENTRY_IS_BLOCK(*e) || ((got == 3) && (*e & ENTRY_VALID))) {
+                sz = 1ULL << PT_LEVEL_SHIFT(got);
+                break;
+            }
+
+            if (lvl == 3) {
+                *e = pa | attr | ENTRY_PAGE | ENTRY_VALID;
+                break;
+            }
+
+            if ((align_dn(pa, sz) != pa) || (phy_hi - pa < sz) || !pgtbl_empty(e, lvl)) {
+                continue;
+            }
+
+            // break before make: the walker may hold on to the old table
+            if (*e & ENTRY_VALID) {
+                kpt_free(p2v(*e & PG_ADDR_MASK));
+                *e = 0;
+                invalidate_tlb_el1();
+                asm("dsb ish; isb" : : :);
+            }
+
+            *e = pa | attr | ENTRY_BLOCK | ENTRY_VALID;
+            break;
+        }
+    }
+
+    asm("dsb ishst" : : :);
     invalidate_tlb_el1();
+    asm("dsb ish; isb" : : :);
 }
@@ -0,0 +1,330 @@
+// Mapped regions of a process, and the mmap, munmap and mprotect calls
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "proc.h"
+#include "stat.h"
+#include "fs.h"
+#include "file.h"
+#include "mman.h"
+
+// exec maps the segments of the program below proc->sz, and mmap adds
+// regions between UMMAP_BASE and UADDR_SZ; the heap grows in between.
+// A region only records what its pages hold: pagefault fills them in
+// on first touch. Regions can be cut at any page boundary (munmap and
+// mprotect on part of one), so file-backed ones are described by the
+// address range they read from the file, which stays the same for all
+// the pieces. Shared file mappings are written back to the file when
+// they are unmapped, at munmap, exec or exit.
+
+static struct kmem_cache *vma_cache;
+
+void vma_init (void)
+{
+    if ((vma_cache = kmem_cache_create("vma", sizeof(struct vma), 0)) == NULL) {
+        panic("vma_init: vma cache");
+    }
+}
+
+// Return the region of list that contains va, or 0.
+struct vma* vma_find (struct vma *list, uint64 va)
+{
+    for (; (list != 0) && (list->start <= va); list = list->next) {
+        if (va < list->end) {
+            return list;
+        }
+    }
+
+    return 0;
+}
+
+// Add a copy of tmpl to list, taking a reference to its file or shared
+// memory segment. The range of tmpl must not overlap the regions of
+// list.
+int vma_add (struct vma **list, struct vma *tmpl)
+{
+    struct vma *v;
+
+    if ((v = kmem_cache_alloc(vma_cache)) == 0) {
+        return -1;
+    }
+
+    *v = *tmpl;
+
+    if (v->ip) {
+        idup(v->ip);
+    }
+
+    if (v->shm) {
+        shm_dup(v->shm);
+    }
+
+    while ((*list != 0) && ((*list)->start < v->start)) {
+        list = &(*list)->next;
+    }
+
+    v->next = *list;
+    *list = v;
+
+    return 0;
+}
+
+// give back v and its file or segment reference
+static void vma_put (struct vma *v)
+{
+    if (v->ip) {
+        iput(v->ip);
+    }
+
+    if (v->shm) {
+        shm_put(v->shm);
+    }
+
+    kmem_cache_free(vma_cache, v);
+}
+
+// cut the region of list that contains addr in two at addr, if addr is
+// inside it, so that no region straddles addr
+static int vma_split (struct vma **list, uint64 addr)
+{
+    struct vma *v, *n;
+
+    if (((v = vma_find(*list, addr)) == 0) || (v->start == addr)) {
+        return 0;
+    }
+
+    if ((n = kmem_cache_alloc(vma_cache)) == 0) {
+        return -1;
+    }
+
+    *n = *v;
+    n->start = addr;
+    v->end = addr;
+    v->next = n;
+
+    if (n->ip) {
+        idup(n->ip);
+    }
+
+    if (n->shm) {
+        shm_dup(n->shm);
+    }
+
+    return 0;
+}
+
+// Copy the regions of src for a child (fork). On failure, nothing is
+// left in dst.
+int vma_dup (struct vma **dst, struct vma *src)
+{
+    struct vma **pp;
+
+    *dst = 0;
+
+    for (pp = dst; src != 0; src = src->next) {
+        if (vma_add(pp, src) < 0) {
+            vma_free(dst, 0);
+            return -1;
+        }
+
+        pp = &(*pp)->next;
+    }
+
+    return 0;
+}
+
+// Drop all regions of list. If pgdir is given, the shared file mappings
+// are written back from it first; its pages are left to the caller.
+void vma_free (struct vma **list, pgd_t *pgdir)
+{
+    struct vma *v;
+
+    while ((v = *list) != 0) {
+        *list = v->next;
+
+        if (pgdir) {
+            syncuvm(pgdir, v);
+        }
+
+        vma_put(v);
+    }
+}
+
+// first free range of len bytes above UMMAP_BASE, or 0
+static uint64 vma_gap (struct vma *list, uint64 len)
+{
+    uint64 a;
+
+    a = UMMAP_BASE;
+
+    for (; list != 0; list = list->next) {
+        if (list->end <= a) {
+            continue;
+        }
+
+        if (list->start >= a + len) {
+            break;
+        }
+
+        a = list->end;
+    }
+
+    return (a + len <= UADDR_SZ) ? a : 0;
+}
+
+// is [addr, addr+len) a page aligned range of user space, from lo up
+static int vma_range (uint64 addr, uint64 len, uint64 lo)
+{
+    return ((addr % PTE_SZ) == 0) && (len > 0) && (addr >= lo) &&
+           (addr <= UADDR_SZ) && (len <= UADDR_SZ - addr);
+}
+
+// Map len bytes of f from off (page aligned) into the current process,
+// or zeroes with MAP_ANONYMOUS. f may also be a shared memory segment
+// (see shmget), which is only mapped shared and not beyond its end. The
+// mapping goes at addr with MAP_FIXED, replacing whatever is there, and
+// at the first free range above UMMAP_BASE otherwise. Returns the
+// address, or -1.
+uint64 mmap (uint64 addr, uint64 len, int prot, int flags, struct file *f, uint64 off)
+{
+    struct vma v;
+    int type;
+
+    type = flags & (MAP_SHARED | MAP_PRIVATE);
+
+    if ((len == 0) || (len > UADDR_SZ - UMMAP_BASE) || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) ||
+        ((type != MAP_SHARED) && (type != MAP_PRIVATE))) {
+        return -1;
+    }
+
+    memset(&v, 0, sizeof(v));
+    v.prot = prot;
+    v.maxprot = PROT_READ | PROT_WRITE | PROT_EXEC;
+    v.flags = type;
+
+    if (flags & MAP_ANONYMOUS) {
+        // pages are filled in on first touch, which is too late for fork
+        // to share them, so anonymous memory is always private
+        if (type == MAP_SHARED) {
+            return -1;
+        }
+
+    } else if ((f != 0) && (f->type == FD_SHM)) {
+        if ((type != MAP_SHARED) || (off % PTE_SZ) || (off > shm_size(f->shm)) ||
+            (len > shm_size(f->shm) - off)) {
+            return -1;
+        }
+
+        v.shm = f->shm;
+        v.off = off;
+
+    } else {
+        if ((f == 0) || (f->type != FD_INODE) || !f->readable || (f->ip->type != T_FILE) ||
+            (off % PTE_SZ)) {
+            return -1;
+        }
+
+        // a shared mapping writes to the file
+        if ((type == MAP_SHARED) && !f->writable) {
+            v.maxprot &= ~PROT_WRITE;
+        }
+
+        if (prot & ~v.maxprot) {
+            return -1;
+        }
+
+        v.ip = f->ip;
+        v.off = off;
+    }
+
+    if (flags & MAP_FIXED) {
+        if (!vma_range(addr, len, UMMAP_BASE) || (munmap(addr, len) < 0)) {
+            return -1;
+        }
+
+    } else if ((addr = vma_gap(proc->vmas, align_up(len, PTE_SZ))) == 0) {
+        return -1;
+    }
+
+    v.start = addr;
+    v.end = addr + align_up(len, PTE_SZ);
+    v.fstart = addr;
+    v.fend = addr + len;
+
+    if (vma_add(&proc->vmas, &v) < 0) {
+        return -1;
+    }
+
+    return addr;
+}
+
+// Unmap the pages of [addr, addr+len) of the current process that mmap
+// mapped, writing back shared file mappings. Returns -1 if the range is
+// not page aligned or outside the mmap area.
+int munmap (uint64 addr, uint64 len)
+{
+    struct vma **pp, *v;
+    uint64 end;
+
+    if (!vma_range(addr, len, UMMAP_BASE)) {
+        return -1;
+    }
+
+    end = align_up(addr + len, PTE_SZ);
+
+    if ((vma_split(&proc->vmas, addr) < 0) || (vma_split(&proc->vmas, end) < 0)) {
+        return -1;
+    }
+
+    for (pp = &proc->vmas; (v = *pp) != 0; ) {
+        if ((v->start < addr) || (v->end > end)) {
+            pp = &v->next;
+            continue;
+        }
+
+        *pp = v->next;
+
+        syncuvm(proc->pgdir, v);
+        deallocuvm(proc->pgdir, v->end, v->start);
+        vma_put(v);
+    }
+
+    return 0;
+}
+
+// Change the protection of the pages of [addr, addr+len) of the current
+// process to prot. Returns -1 if part of the range is not mapped, or a
+// region cannot have prot (a shared mapping of a read-only file).
+int mprotect (uint64 addr, uint64 len, int prot)
+{
+    struct vma *v;
+    uint64 a, end;
+
+    if (!vma_range(addr, len, 0) || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+        return -1;
+    }
+
+    end = align_up(addr + len, PTE_SZ);
+
+    // check the whole range before changing any of it
+    for (a = addr; a < end; a = v->end) {
+        if (((v = vma_find(proc->vmas, a)) == 0) || (prot & ~v->maxprot)) {
+            return -1;
+        }
+    }
+
+    if ((vma_split(&proc->vmas, addr) < 0) || (vma_split(&proc->vmas, end) < 0)) {
+        return -1;
+    }
+
+    for (v = vma_find(proc->vmas, addr); (v != 0) && (v->start < end); v = v->next) {
+        v->prot = prot;
+
+        if (protuvm(proc->pgdir, v) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,122 @@
+// Pool of pre-zeroed pages
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "spinlock.h"
+#include "arm.h"
+#include "shrinker.h"
+
+// Page tables and fresh user pages must be zero-filled. Instead of paying
+// for the memset on the allocation path (sbrk, exec, fork), the idle loop
+// of the scheduler zeroes free pages in the background and keeps them in
+// this pool; alloc_zeroed_page only clears a page itself when the pool
+// has run dry. The pool is a stack of page pointers, so the pages stay
+// entirely zero while they wait.
+
+#define ZPOOL_MAX    64
+
+static struct {
+    struct spinlock lock;
+    int             cnt;                // pool depth
+    void*           pages[ZPOOL_MAX];
+
+    uint64          hits;               // served from the pool
+    uint64          misses;             // zeroed on the allocation path
+    uint64          zeroed;             // zeroed in the background
+} zpool;
+
+// give up to nr pool pages back to the allocator under memory pressure
+static int zpool_shrink (int nr)
+{
+    void *pg;
+    int n;
+
+    for (n = 0; n < nr; n++) {
+        acquire(&zpool.lock);
+        pg = (zpool.cnt > 0) ? zpool.pages[--zpool.cnt] : NULL;
+        release(&zpool.lock);
+
+        if (pg == NULL) {
+            break;
+        }
+
+        free_page(pg);
+    }
+
+    return n;
+}
+
+static struct shrinker zpool_shrinker = {
+    .name   = "zpool",
+    .shrink = zpool_shrink,
+};
+
+void zpool_init (void)
+{
+    initlock(&zpool.lock, "zpool");
+    register_shrinker(&zpool_shrinker);
+}
+
+// allocate a page that is filled with zeroes
+void* alloc_zeroed_page (void)
+{
+    void *pg;
+
+    pg = NULL;
+
+    acquire(&zpool.lock);
+
+    if (zpool.cnt > 0) {
+        pg = zpool.pages[--zpool.cnt];
+        zpool.hits++;
+    } else {
+        zpool.misses++;
+    }
+
+    release(&zpool.lock);
+
+    if ((pg == NULL) && ((pg = alloc_page()) != NULL)) {
+        memset(pg, 0, PTE_SZ);
+    }
+
+    return pg;
+}
+
+// zero one free page into the pool. Called from the idle loop, returns
+// 0 once the pool is full (or memory is short) so the caller can stop.
+int zpool_refill (void)
+{
+    void *pg;
+
+    if (zpool.cnt >= ZPOOL_MAX || (pg = alloc_page()) == NULL) {
+        return 0;
+    }
+
+    memset(pg, 0, PTE_SZ);
+
+    acquire(&zpool.lock);
+
+    if (zpool.cnt < ZPOOL_MAX) {
+        zpool.pages[zpool.cnt++] = pg;
+        zpool.zeroed++;
+        pg = NULL;
+    }
+
+    release(&zpool.lock);
+
+    if (pg != NULL) {
+        free_page(pg);
+        return 0;
+    }
+
+    return 1;
+}
+
+void zpool_dump (void)
+{
+    cprintf("zpool: depth %d/%d, hits %d, misses %d, zeroed %d\n",
+            zpool.cnt, ZPOOL_MAX, (uint)zpool.hits, (uint)zpool.misses,
+            (uint)zpool.zeroed);
+}